@@ -29,6 +29,7 @@
 
 static volatile uint64_t *hpet;
 static time_t ticksperus;
+static uint64_t frequency;
 static uint64_t tickspassed;
 
 // in order of preference
@@ -56,6 +57,10 @@ time_t arch_hpet_ticks() {
 	}
 }
 
+uint64_t arch_hpet_frequency() {
+	return frequency;
+}
+
 void arch_hpet_waitticks(time_t ticks) {
 	uint64_t target = arch_hpet_ticks() + ticks;
 	while (target > arch_hpet_ticks()) asm volatile("pause");
@@ -97,6 +102,7 @@ time_t arch_hpet_init() {
 	uint64_t capabilities = read64(HPET_REG_CAPS);
 
 	ticksperus = 1000000000 / HPET_CAP_FSPERTICK(capabilities);
+	frequency = 1000000000000000 / HPET_CAP_FSPERTICK(capabilities);
 	printf("hpet%lu: %lu ticks per us (%lu fs per tick)\n", table->number, ticksperus, HPET_CAP_FSPERTICK(capabilities));
 	__assert(ticksperus);
 
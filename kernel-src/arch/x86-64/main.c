@@ -13,6 +13,7 @@
 #include <arch/acpi.h>
 #include <arch/apic.h>
 #include <arch/hpet.h>
+#include <arch/tsc.h>
 #include <kernel/timekeeper.h>
 #include <kernel/scheduler.h>
 #include <kernel/vfs.h>
@@ -20,6 +21,7 @@
 #include <kernel/initrd.h>
 #include <kernel/devfs.h>
 #include <kernel/pseudodevices.h>
+#include <kernel/kstat.h>
 #include <arch/ps2.h>
 #include <kernel/keyboard.h>
 #include <kernel/console.h>
@@ -64,8 +66,11 @@ void kernel_entry() {
 	arch_apic_init();
 	cpu_initstate();
 	// XXX fall back to another clock source
-	time_t u = arch_hpet_init();
-	timekeeper_init(arch_hpet_ticks, u);
+	arch_hpet_init();
+	if (arch_tsc_init())
+		timekeeper_init(arch_tsc_ticks, arch_tsc_frequency(), true);
+	else
+		timekeeper_init(arch_hpet_ticks, arch_hpet_frequency(), false);
 	arch_apic_timerinit();
 	sched_init();
 	arch_smp_wakeup();
@@ -74,6 +79,8 @@ void kernel_entry() {
 	acpi_init();
 
 	vmmcache_init();
+	pmm_zeropoolinit();
+	slab_reclaiminit();
 
 	vfs_init();
 	tmpfs_init();
@@ -97,6 +104,7 @@ void kernel_entry() {
 	block_init();
 	oss_init();
 	pseudodevices_init();
+	kstat_init();
 	arch_e9_initdev();
 	keyboard_init();
 	mouse_init();
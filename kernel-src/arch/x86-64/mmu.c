@@ -7,6 +7,8 @@
 #include <kernel/vmm.h>
 #include <arch/cpu.h>
 #include <arch/smp.h>
+#include <util.h>
+#include <cpuid.h>
 
 #define ADDRMASK (uint64_t)0x7ffffffffffff000
 #define   PTMASK (uint64_t)0b111111111000000000000
@@ -28,9 +30,16 @@ static inline uint64_t* next(uint64_t entry) {
 #define DEPTH_PD 2
 #define DEPTH_PT 3
 
-// returns pointer to the entry
+#define ENTRY_LARGE ((uint64_t)1 << 7)
+#define ENTRY_GLOBAL ((uint64_t)1 << 8)
 
-static uint64_t *get_page(pagetableptr_t top, void *vaddr) {
+#define PAGESIZE_2M ((size_t)ARCH_MMU_LARGEPAGE_SIZE)
+#define PAGESIZE_1G ((size_t)0x40000000)
+
+// returns pointer to the entry. 2M and 1G pages (used for the hhdm, the kernel image and huge user pages)
+// return the entry of their level, with pagesize set accordingly if not NULL
+
+static uint64_t *get_entry(pagetableptr_t top, void *vaddr, size_t *pagesize) {
 	uint64_t *pml4 = MAKE_HHDM(top);
 	uintptr_t addr = (uintptr_t)vaddr;
 	uintptr_t ptoffset = (addr & PTMASK) >> 12;
@@ -42,17 +51,35 @@ static uint64_t *get_page(pagetableptr_t top, void *vaddr) {
 	if (pdpt == NULL)
 		return NULL;
 
+	if (pdpt[pdptoffset] & ENTRY_LARGE) {
+		if (pagesize)
+			*pagesize = PAGESIZE_1G;
+		return pdpt + pdptoffset;
+	}
+
 	uint64_t *pd = next(pdpt[pdptoffset]);
 	if (pd == NULL)
 		return NULL;
+
+	if (pd[pdoffset] & ENTRY_LARGE) {
+		if (pagesize)
+			*pagesize = PAGESIZE_2M;
+		return pd + pdoffset;
+	}
 	
 	uint64_t *pt = next(pd[pdoffset]);
 	if (pt == NULL)
 		return NULL;
 
+	if (pagesize)
+		*pagesize = PAGE_SIZE;
 	return pt + ptoffset;
 }
 
+static inline uint64_t *get_page(pagetableptr_t top, void *vaddr) {
+	return get_entry(top, vaddr, NULL);
+}
+
 // inserts an entry
 
 static bool add_page(pagetableptr_t top, void *vaddr, uint64_t entry, int depth) {
@@ -119,6 +146,10 @@ static void destroy(uint64_t *table, int depth) {
 		if (addr == NULL)
 			continue;
 
+		// huge pages are released by the vmm when unmapping them, so nothing should be left here
+		if (depth == 1 && (table[i] & ENTRY_LARGE))
+			continue;
+
 		if (depth > 0)
 			destroy(MAKE_HHDM(addr), depth - 1);
 
@@ -126,13 +157,22 @@ static void destroy(uint64_t *table, int depth) {
 	}
 }
 
+static void forgetpcid(pagetableptr_t table);
+
 void arch_mmu_destroytable(pagetableptr_t table) {
+	// the page could be reused for another table, which mustn't see the old entries
+	forgetpcid(table);
 	destroy(MAKE_HHDM(table), 3);
 	pmm_release(table);
 }
 
+// kernel mappings are the same in every table, so they are marked global to survive cr3 reloads
+static inline uint64_t globalflag(void *vaddr) {
+	return vaddr >= KERNELSPACE_START ? ENTRY_GLOBAL : 0;
+}
+
 bool arch_mmu_map(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags) {
-	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags;
+	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags | globalflag(vaddr);
 	return add_page(table, vaddr, entry, 0);
 }
 
@@ -144,18 +184,28 @@ void arch_mmu_unmap(pagetableptr_t table, void *vaddr) {
 }
 
 void arch_mmu_remap(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags) {
-	uint64_t *entryptr = get_page(table, vaddr);
+	size_t pagesize;
+	uint64_t *entryptr = get_entry(table, vaddr, &pagesize);
 	if (entryptr == NULL)
 		return;
 	uintptr_t addr = paddr == NULL ? (*entryptr & ADDRMASK) : ((uintptr_t)paddr & ADDRMASK);
-	*entryptr = addr | flags;
+	if (pagesize != PAGE_SIZE) {
+		// paddr can be any of the 4k pages inside of the large page
+		addr &= ~(pagesize - 1);
+		flags |= ENTRY_LARGE;
+	}
+	*entryptr = addr | flags | globalflag(vaddr);
 }
 
 void *arch_mmu_getphysical(pagetableptr_t table, void *vaddr) {
-	uint64_t *entry = get_page(table, vaddr);
-	if (entry == NULL)
+	size_t pagesize;
+	uint64_t *entry = get_entry(table, vaddr, &pagesize);
+	if (entry == NULL || *entry == 0)
 		return NULL;
-	return (void *)(*entry & ADDRMASK);
+
+	// return the 4k page inside of a large page
+	uintptr_t offset = ROUND_DOWN((uintptr_t)vaddr % pagesize, PAGE_SIZE);
+	return (void *)((*entry & ADDRMASK & ~(pagesize - 1)) + offset);
 }
 
 bool arch_mmu_ispresent(pagetableptr_t table, void *vaddr) {
@@ -187,8 +237,225 @@ bool arch_mmu_getflags(pagetableptr_t table, void *vaddr, mmuflags_t *mmuflagsp)
 	return true;
 }
 
-void arch_mmu_switch(pagetableptr_t table) {
-	asm volatile("mov %%rax, %%cr3" : : "a"(table));
+static uint64_t *get_pdentry(pagetableptr_t top, void *vaddr) {
+	uint64_t *pml4 = MAKE_HHDM(top);
+	uintptr_t addr = (uintptr_t)vaddr;
+	uint64_t *pdpt = next(pml4[(addr & PML4MASK) >> 39]);
+	if (pdpt == NULL)
+		return NULL;
+
+	uint64_t *pd = next(pdpt[(addr & PDPTMASK) >> 30]);
+	if (pd == NULL)
+		return NULL;
+
+	return pd + ((addr & PDMASK) >> 21);
+}
+
+// a huge page can only be mapped where there is no page table yet
+bool arch_mmu_canmaplarge(pagetableptr_t table, void *vaddr) {
+	uint64_t *entry = get_pdentry(table, vaddr);
+	return entry == NULL || *entry == 0;
+}
+
+bool arch_mmu_maplarge(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags) {
+	__assert(((uintptr_t)paddr % PAGESIZE_2M) == 0 && ((uintptr_t)vaddr % PAGESIZE_2M) == 0);
+	if (arch_mmu_canmaplarge(table, vaddr) == false)
+		return false;
+
+	uint64_t entry = ((uintptr_t)paddr & ADDRMASK) | flags | ENTRY_LARGE | globalflag(vaddr);
+	return add_page(table, vaddr, entry, DEPTH_PT);
+}
+
+bool arch_mmu_islarge(pagetableptr_t table, void *vaddr) {
+	size_t pagesize;
+	uint64_t *entry = get_entry(table, vaddr, &pagesize);
+	return entry && *entry && pagesize == PAGESIZE_2M;
+}
+
+// replaces a 2M page with a page table mapping the same memory with the same flags.
+// the 4k pages were all allocated separately so their refcounts stay the same. the caller invalidates
+bool arch_mmu_splitlarge(pagetableptr_t table, void *vaddr) {
+	uint64_t *entry = get_pdentry(table, vaddr);
+	__assert(entry && (*entry & ENTRY_LARGE));
+
+	uint64_t *pt = pmm_allocpage(PMM_SECTION_DEFAULT);
+	if (pt == NULL)
+		return false;
+
+	uint64_t base = *entry & ADDRMASK & ~(PAGESIZE_2M - 1);
+	uint64_t flags = *entry & ~ADDRMASK & ~ENTRY_LARGE;
+	uint64_t *ptentries = MAKE_HHDM(pt);
+	for (int i = 0; i < 512; ++i)
+		ptentries[i] = (base + i * PAGE_SIZE) | flags;
+
+	*entry = (uint64_t)pt | INTERMEDIATE_FLAGS;
+	return true;
+}
+
+#define COPY_BATCH_SIZE 64
+
+typedef struct {
+	void *pages[COPY_BATCH_SIZE];
+	size_t count;
+	bool hold;
+} copybatch_t;
+
+static void flushbatch(copybatch_t *batch) {
+	if (batch->hold && batch->count)
+		pmm_holdmany(batch->pages, batch->count);
+	batch->count = 0;
+}
+
+// copies the entries of a table covering [start, end). level 3 is the pml4 and level 0 is a page table.
+// empty entries are skipped as a whole and leaf entries are write protected in both tables
+static bool copylevel(uint64_t *dest, uint64_t *src, uintptr_t start, uintptr_t end, int level, copybatch_t *batch) {
+	int shift = 12 + level * 9;
+	uintptr_t entrysize = (uintptr_t)1 << shift;
+
+	for (uintptr_t addr = start; addr < end; addr = ROUND_DOWN(addr, entrysize) + entrysize) {
+		int index = (addr >> shift) & 511;
+		uint64_t entry = src[index];
+		if (entry == 0)
+			continue;
+
+		if (level == 0 || (entry & ENTRY_LARGE)) {
+			entry &= ~ARCH_MMU_FLAGS_WRITE;
+			src[index] = entry;
+			dest[index] = entry;
+			// a huge page holds every 4k page in it
+			uintptr_t base = entry & ADDRMASK & ~(entrysize - 1);
+			for (uintptr_t offset = 0; offset < entrysize; offset += PAGE_SIZE) {
+				batch->pages[batch->count++] = (void *)(base + offset);
+				if (batch->count == COPY_BATCH_SIZE)
+					flushbatch(batch);
+			}
+			continue;
+		}
+
+		uint64_t *desttable = next(dest[index]);
+		if (desttable == NULL) {
+			desttable = pmm_allocpage(PMM_SECTION_DEFAULT);
+			if (desttable == NULL)
+				return false;
+			dest[index] = (uint64_t)desttable | INTERMEDIATE_FLAGS;
+			desttable = MAKE_HHDM(desttable);
+			memset(desttable, 0, PAGE_SIZE);
+		}
+
+		uintptr_t top = ROUND_DOWN(addr, entrysize) + entrysize;
+		if (!copylevel(desttable, next(entry), addr, top < end ? top : end, level - 1, batch))
+			return false;
+	}
+
+	return true;
+}
+
+// copies the mappings in a range from src to dest for copy on write, removing write access in both.
+// if hold is set the mapped pages get their refcount increased. the caller is expected to invalidate src
+bool arch_mmu_copyrange(pagetableptr_t dest, pagetableptr_t src, void *start, size_t size, bool hold) {
+	copybatch_t batch = {
+		.count = 0,
+		.hold = hold
+	};
+
+	bool status = copylevel(MAKE_HHDM(dest), MAKE_HHDM(src), (uintptr_t)start, (uintptr_t)start + size, 3, &batch);
+	flushbatch(&batch);
+	return status;
+}
+
+#define CR3_NOFLUSH ((uint64_t)1 << 63)
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CPUID_PCID (1 << 17)
+#define CPUID_INVPCID (1 << 10)
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_ALL 2
+
+static bool pcidsupported;
+static bool invpcidsupported;
+
+static inline void invpcid(int type, uint64_t pcid, void *address) {
+	struct {
+		uint64_t pcid;
+		uint64_t address;
+	} descriptor = {
+		.pcid = pcid,
+		.address = (uint64_t)address
+	};
+
+	asm volatile("invpcid %0, %1" : : "m"(descriptor), "r"((uint64_t)type) : "memory");
+}
+
+// flushes the tlb entries of every PCID, including global ones
+static inline void flushall() {
+	if (invpcidsupported) {
+		invpcid(INVPCID_ALL, 0, NULL);
+	} else {
+		// toggling PGE flushes everything
+		uint64_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile("mov %0, %%cr4; mov %1, %%cr4" : : "r"(cr4 ^ CR4_PGE), "r"(cr4) : "memory");
+	}
+}
+
+// with PCIDs, every cpu hands them out from its own set of slots, so switching back to a recently used
+// address space keeps its tlb entries. a slot is only valid if its generation matches the one of the cpu,
+// and running out of slots starts a new generation, recycling all of them at once. a table getting a slot
+// is loaded without the no flush bit, which drops whatever the previous owner of the PCID left in the tlb.
+// PCID 0 is only used by the template.
+// the cpu is added to cpus before the switch, so shootdowns for the address space will reach it
+void arch_mmu_switch(pagetableptr_t table, mmucpumask_t *cpus) {
+	bool intstatus = interrupt_set(false);
+	cpu_t *cpu = current_cpu();
+	__atomic_or_fetch(&cpus->bits[cpu->number / 64], (uint64_t)1 << (cpu->number % 64), __ATOMIC_SEQ_CST);
+
+	if (pcidsupported == false) {
+		asm volatile("mov %%rax, %%cr3" : : "a"(table) : "memory");
+		interrupt_set(intstatus);
+		return;
+	}
+
+	uint64_t cr3 = (uint64_t)table;
+
+	int slot;
+	for (slot = 0; slot < ARCH_MMU_PCID_COUNT; ++slot) {
+		if (cpu->pcidslots[slot].table == table && cpu->pcidslots[slot].generation == cpu->pcidgeneration)
+			break;
+	}
+
+	if (slot < ARCH_MMU_PCID_COUNT) {
+		cr3 |= CR3_NOFLUSH;
+	} else {
+		if (cpu->pcidnext == ARCH_MMU_PCID_COUNT) {
+			++cpu->pcidgeneration;
+			cpu->pcidnext = 0;
+		}
+
+		slot = cpu->pcidnext++;
+		cpu->pcidslots[slot].table = table;
+		cpu->pcidslots[slot].generation = cpu->pcidgeneration;
+	}
+
+	cr3 |= slot + 1;
+	asm volatile("mov %%rax, %%cr3" : : "a"(cr3) : "memory");
+	interrupt_set(intstatus);
+}
+
+static void forgetcpupcid(cpu_t *cpu, pagetableptr_t table) {
+	for (int slot = 0; slot < ARCH_MMU_PCID_COUNT; ++slot) {
+		pagetableptr_t expected = table;
+		__atomic_compare_exchange_n(&cpu->pcidslots[slot].table, &expected, NULL, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+}
+
+// makes every cpu drop the PCID of a table, so the next switch to it starts with a clean tlb
+static void forgetpcid(pagetableptr_t table) {
+	if (pcidsupported == false)
+		return;
+
+	for (int i = 0; i < (smp_cpus ? arch_smp_cpusawake : 1); ++i)
+		forgetcpupcid(smp_cpus ? smp_cpus[i] : current_cpu(), table);
 }
 
 // hhdm pointer to template to be used for new mappings and smp bootup
@@ -202,66 +469,148 @@ pagetableptr_t arch_mmu_newtable() {
 	return table;
 }
 
-static void *shootdown_page;
-static size_t shootdown_size;
-static spinlock_t shootdown_lock;
-static int shootdown_remaining = 0;
-
-static inline void do_invalidate(void *page, size_t size) {
-	// if a full reload was requested or we are doing a big release on 
-	if (page == NULL || size >= 128 * PAGE_SIZE) {
-		// TODO if global pages are ever supported, we should disable them in CR4, flush, and then reenable them
+typedef struct mmushootdown_t {
+	mmutlbbatch_t *batch;
+	vmmcontext_t *context; // NULL for kernel invalidations
+	int remaining;
+} mmushootdown_t;
+
+static inline void do_invalidate(mmutlbbatch_t *batch) {
+	if (batch->kernel && (batch->all || batch->pages >= 128)) {
+		// the kernel mappings are global, so a cr3 reload wouldn't get rid of them
+		flushall();
+	} else if (batch->all || batch->pages >= 128) {
+		// if a full reload was requested or we are doing a big release on userspace
 		asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3;" : : : "rax", "memory");
 	} else {
-		for (uintptr_t i = 0; i < size; i += PAGE_SIZE) {
-			uintptr_t ptr = (uintptr_t)page + i;
-			asm volatile ("invlpg (%%rax)" : : "a"(ptr) : "memory");
+		// invlpg also gets rid of global entries, no matter the PCID they were cached under
+		for (int range = 0; range < batch->count; ++range) {
+			for (uintptr_t i = 0; i < batch->ranges[range].size; i += PAGE_SIZE) {
+				uintptr_t ptr = (uintptr_t)batch->ranges[range].page + i;
+				asm volatile ("invlpg (%%rax)" : : "a"(ptr) : "memory");
+			}
 		}
 	}
 }
 
 void arch_mmu_tlbipi(isr_t *isr, context_t *context) {
-	do_invalidate(shootdown_page, shootdown_size);
-	__atomic_sub_fetch(&shootdown_remaining, 1, __ATOMIC_SEQ_CST);
+	cpu_t *cpu = current_cpu();
+	mmushootdown_t *queue[ARCH_MMU_SHOOTDOWN_QUEUE_SIZE];
+
+	spinlock_acquire(&cpu->shootdownlock);
+	int count = cpu->shootdowncount;
+	memcpy(queue, cpu->shootdownqueue, count * sizeof(mmushootdown_t *));
+	cpu->shootdowncount = 0;
+	spinlock_release(&cpu->shootdownlock);
+
+	for (int i = 0; i < count; ++i) {
+		mmushootdown_t *shootdown = queue[i];
+		if (shootdown->context == NULL || shootdown->context == current_vmm_context()) {
+			do_invalidate(shootdown->batch);
+		} else {
+			// the address space isn't loaded here anymore. dropping its PCID is enough,
+			// and the cpu won't need to be shot down for it until it switches to it again
+			if (pcidsupported)
+				forgetcpupcid(cpu, shootdown->context->pagetable);
+			__atomic_and_fetch(&shootdown->context->cpus.bits[cpu->number / 64], ~((uint64_t)1 << (cpu->number % 64)), __ATOMIC_SEQ_CST);
+		}
+
+		__atomic_sub_fetch(&shootdown->remaining, 1, __ATOMIC_SEQ_CST);
+	}
 }
 
-// if page == NULL, this will do a userspace shootdown that flushes the whole tlb
-void arch_mmu_invalidate_range(void *page, size_t size) {
+static void queueshootdown(cpu_t *cpu, mmushootdown_t *shootdown) {
+	for (;;) {
+		bool intstatus = spinlock_acquireirqclear(&cpu->shootdownlock);
+		int count = cpu->shootdowncount;
+		if (count < ARCH_MMU_SHOOTDOWN_QUEUE_SIZE)
+			cpu->shootdownqueue[cpu->shootdowncount++] = shootdown;
+		spinlock_releaseirqrestore(&cpu->shootdownlock, intstatus);
+
+		if (count < ARCH_MMU_SHOOTDOWN_QUEUE_SIZE) {
+			// a non empty queue already has an ipi on its way
+			if (count == 0)
+				arch_smp_sendipi(cpu, &cpu->isr[0xfe], ARCH_SMP_IPI_TARGET, false);
+			return;
+		}
+
+		// the queue is full, wait for the cpu to go through it
+		CPU_PAUSE();
+	}
+}
+
+// if page == NULL, the whole userspace tlb is flushed
+void arch_mmu_batchadd(mmutlbbatch_t *batch, void *page, size_t size) {
 	__assert(((uintptr_t)page % PAGE_SIZE) == 0);
-	thread_t *thread = current_thread();
+	bool kernel = page >= KERNELSPACE_START;
+	__assert(batch->count == 0 || batch->all || batch->kernel == kernel);
+	batch->kernel = kernel;
+
+	if (page == NULL || batch->count == ARCH_MMU_BATCH_SIZE) {
+		batch->all = true;
+		return;
+	}
+
+	batch->ranges[batch->count].page = page;
+	batch->ranges[batch->count].size = size;
+	batch->pages += size / PAGE_SIZE;
+	++batch->count;
+}
+
+// invalidates the batch on this cpu and on any other cpu which could have the entries in its tlb:
+// every cpu for the kernel, or the cpus the current address space was loaded on for userspace.
+// the batch is empty afterwards
+void arch_mmu_invalidate_batch(mmutlbbatch_t *batch) {
+	if (batch->count == 0 && batch->all == false)
+		return;
 
-	bool do_shootdown = // do shootdown if
-		current_thread() // scheduler is up
-		&& arch_smp_cpusawake >= 2 // and there are multiple cpus in the system
-		&& (page >= KERNELSPACE_START // and its either in the kernel
-		|| ((page == NULL || (page >= USERSPACE_START && page < USERSPACE_END)) // or in userspace...
-			&& thread->proc && thread->proc->runningthreadcount > 1)); // in a process which has multiple threads running
+	vmmcontext_t *vmmcontext = batch->kernel ? NULL : current_vmm_context();
+	mmushootdown_t shootdown = {
+		.batch = batch,
+		.context = vmmcontext,
+		.remaining = 0
+	};
 
-	int old_ipl;
-	if (do_shootdown) {
-		old_ipl = interrupt_raiseipl(IPL_DPC);
-		spinlock_acquire(&shootdown_lock);
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	cpu_t *self = current_cpu();
 
-		shootdown_page = page;
-		shootdown_size = size;
-		shootdown_remaining = arch_smp_cpusawake - 1;
+	// the page table updates (plain stores) could otherwise be reordered after the loads of the cpu mask,
+	// missing a cpu which loaded the address space in between and already walked the old entries.
+	// pairs with the locked or of the mask in arch_mmu_switch
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
+	// do shootdown if the scheduler is up and there are multiple cpus in the system
+	if (current_thread() && arch_smp_cpusawake >= 2 && (batch->kernel || vmmcontext)) {
 		for (int i = 0; i < arch_smp_cpusawake; ++i) {
-			if (smp_cpus[i] == current_cpu())
+			cpu_t *cpu = smp_cpus[i];
+			if (cpu == self)
+				continue;
+
+			if (vmmcontext && (__atomic_load_n(&vmmcontext->cpus.bits[cpu->number / 64], __ATOMIC_SEQ_CST) & ((uint64_t)1 << (cpu->number % 64))) == 0)
 				continue;
 
-			arch_smp_sendipi(smp_cpus[i], &smp_cpus[i]->isr[0xfe], ARCH_SMP_IPI_TARGET, false);
+			__atomic_add_fetch(&shootdown.remaining, 1, __ATOMIC_SEQ_CST);
+			queueshootdown(cpu, &shootdown);
 		}
 	}
 
-	do_invalidate(page, size);
+	do_invalidate(batch);
 
-	if (do_shootdown) {
-		while (__atomic_load_n(&shootdown_remaining, __ATOMIC_SEQ_CST)) CPU_PAUSE();
+	// interrupts are left enabled, so shootdowns from other cpus can be handled while waiting
+	while (__atomic_load_n(&shootdown.remaining, __ATOMIC_SEQ_CST)) CPU_PAUSE();
 
-		spinlock_release(&shootdown_lock);
-		interrupt_loweripl(old_ipl);
-	}
+	interrupt_loweripl(oldipl);
+
+	batch->count = 0;
+	batch->pages = 0;
+	batch->all = false;
+}
+
+// if page == NULL, this will do a userspace shootdown that flushes the whole tlb
+void arch_mmu_invalidate_range(void *page, size_t size) {
+	mmutlbbatch_t batch = {0};
+	arch_mmu_batchadd(&batch, page, size);
+	arch_mmu_invalidate_batch(&batch);
 }
 
 extern void *_text_start;
@@ -336,6 +685,37 @@ static void gpfisr(isr_t *self, context_t *ctx) {
 	}
 }
 
+#define CPUID_1GBPAGES (1 << 26)
+
+static bool gbpagessupported;
+
+// maps a physically contiguous region into the template using the biggest pages the alignment allows
+static void mapregion(void *vaddr, uintptr_t physical, size_t length, mmuflags_t flags) {
+	uintptr_t virt = (uintptr_t)vaddr;
+	uintptr_t top = virt + length;
+
+	while (virt < top) {
+		size_t left = top - virt;
+		size_t pagesize = PAGE_SIZE;
+		int depth = 0;
+		uint64_t entry = (physical & ADDRMASK) | flags | ENTRY_GLOBAL;
+
+		if (gbpagessupported && left >= PAGESIZE_1G && (virt % PAGESIZE_1G) == 0 && (physical % PAGESIZE_1G) == 0) {
+			pagesize = PAGESIZE_1G;
+			depth = DEPTH_PD;
+			entry |= ENTRY_LARGE;
+		} else if (left >= PAGESIZE_2M && (virt % PAGESIZE_2M) == 0 && (physical % PAGESIZE_2M) == 0) {
+			pagesize = PAGESIZE_2M;
+			depth = DEPTH_PT;
+			entry |= ENTRY_LARGE;
+		}
+
+		__assert(add_page(FROM_HHDM(template), (void *)virt, entry, depth));
+		virt += pagesize;
+		physical += pagesize;
+	}
+}
+
 void arch_mmu_init() {
 	template = pmm_allocpage(PMM_SECTION_DEFAULT);
 	__assert(template);
@@ -349,7 +729,10 @@ void arch_mmu_init() {
 		template[i] = (uint64_t)entry | INTERMEDIATE_FLAGS;
 	}
 
-	// TODO use 2mb pages
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+	gbpagessupported = edx & CPUID_1GBPAGES;
+
 	// populate hhdm
 
 	for (size_t i = 0; i < pmm_liminemap.response->entry_count; ++i) {
@@ -357,10 +740,7 @@ void arch_mmu_init() {
 		if (e->type != LIMINE_MEMMAP_USABLE && e->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && e->type != LIMINE_MEMMAP_KERNEL_AND_MODULES && e->type != LIMINE_MEMMAP_FRAMEBUFFER)
 			continue;
 
-		for (uint64_t i = 0; i < e->length; i += PAGE_SIZE) {
-			uint64_t entry = ((e->base + i) & ADDRMASK) | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC;
-			__assert(add_page(FROM_HHDM(template), MAKE_HHDM((void *)(e->base + i)), entry, 0));
-		}
+		mapregion(MAKE_HHDM((void *)e->base), e->base, e->length, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC);
 	}
 
 	__assert(kaddrreq.response);
@@ -372,17 +752,32 @@ void arch_mmu_init() {
 		uintptr_t baseptr = (uintptr_t)kerneladdr[i*2];
 		uintptr_t physicalbase = (uintptr_t)kerneladdr[i*2] - kaddrreq.response->virtual_base + kaddrreq.response->physical_base;
 
-		for (uintptr_t off = 0; off < len; off += PAGE_SIZE) {
-			uint64_t entry = ((physicalbase + off) & ADDRMASK) | kernelflags[i];
-			__assert(add_page(FROM_HHDM(template), (void *)(baseptr + off), entry, 0));
-		}
+		mapregion((void *)baseptr, physicalbase, ROUND_UP(len, PAGE_SIZE), kernelflags[i]);
 	}
 
 	arch_mmu_apswitch();
 }
 
 void arch_mmu_apswitch() {
-	arch_mmu_switch(FROM_HHDM(template));
+	// PCIDs might not be enabled on this cpu yet, so load it directly
+	asm volatile("mov %%rax, %%cr3" : : "a"(FROM_HHDM(template)) : "memory");
+
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PGE) : "memory");
+
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID_PCID) {
+		// the template is loaded with PCID 0, as needed to enable them
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE) : "memory");
+
+		__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+		invpcidsupported = ebx & CPUID_INVPCID;
+		pcidsupported = true;
+	}
+
 	interrupt_register(13, gpfisr, NULL, IPL_IGNORE);
 	interrupt_register(14, pfisr, NULL, IPL_IGNORE);
 	interrupt_register(0xfe, arch_mmu_tlbipi, ARCH_EOI, IPL_IGNORE);
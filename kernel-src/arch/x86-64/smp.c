@@ -49,6 +49,11 @@ void arch_smp_haltallothers() {
 
 cpu_t **smp_cpus;
 
+// how many cpus the system has, known from boot before they are woken up
+size_t arch_smp_cpucount() {
+	return smprequest.response ? smprequest.response->cpu_count : 1;
+}
+
 void arch_smp_wakeup() {
 	interrupt_register(0xfd, (void *)cpuwakeuphalt, NULL, IPL_IGNORE);
 	struct limine_smp_response *response = smprequest.response;
@@ -59,6 +64,8 @@ void arch_smp_wakeup() {
 	}
 
 	printf("smp: %d processor%s\n", response->cpu_count, response->cpu_count > 1 ? "s" : "");
+	// cpu numbers index the tlb shootdown masks
+	__assert(response->cpu_count <= ARCH_MMU_MAX_CPUS);
 
 	// use physical pages so the other cpus have it on the hhdm
 	size_t cpu_size = ROUND_UP(sizeof(cpu_t) * response->cpu_count, PAGE_SIZE);
@@ -72,6 +79,8 @@ void arch_smp_wakeup() {
 
 	void (*wakeupfn)(struct limine_smp_info *) = cmdline_get("nosmp") ? cpuwakeuphalt : cpuwakeup;
 
+	int number = 1;
+
 	// make the other processors jump to cpuwakeup()
 	for (int i = 0; i < response->cpu_count; ++i) {
 		// skip the bootstrap processor
@@ -81,6 +90,7 @@ void arch_smp_wakeup() {
 		}
 
 		smp_cpus[i] = &cpus[i];
+		cpus[i].number = number++;
 		response->cpus[i]->extra_argument = (uint64_t)&cpus[i];
 
 		__atomic_store_n(&response->cpus[i]->goto_address, wakeupfn, __ATOMIC_SEQ_CST);
@@ -0,0 +1,49 @@
+#include <arch/tsc.h>
+#include <arch/hpet.h>
+#include <kernel/cmdline.h>
+#include <kernel/interrupt.h>
+#include <logging.h>
+#include <cpuid.h>
+
+#define CPUID_APM_INVARIANTTSC (1 << 8)
+#define CALIBRATION_US 50000
+
+static uint64_t frequency;
+
+// the lfence keeps the read from being done before the instructions preceding it
+time_t arch_tsc_ticks() {
+	uint32_t low, high;
+	asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) : : "memory");
+	return ((uint64_t)high << 32) | low;
+}
+
+uint64_t arch_tsc_frequency() {
+	return frequency;
+}
+
+// the tsc is only used as a clock source if it is invariant, as otherwise its rate changes with the cpu frequency
+// and it might stop in deep sleep states. it is calibrated against the hpet.
+bool arch_tsc_init() {
+	if (cmdline_get("notsc")) {
+		printf("tsc: disabled in the command line\n");
+		return false;
+	}
+
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & CPUID_APM_INVARIANTTSC) == 0) {
+		printf("tsc: not invariant\n");
+		return false;
+	}
+
+	bool intstatus = interrupt_set(false);
+	time_t hpetstart = arch_hpet_ticks();
+	time_t tscstart = arch_tsc_ticks();
+	arch_hpet_waitus(CALIBRATION_US);
+	time_t hpetend = arch_hpet_ticks();
+	time_t tscend = arch_tsc_ticks();
+	interrupt_set(intstatus);
+
+	frequency = (unsigned __int128)(tscend - tscstart) * arch_hpet_frequency() / (hpetend - hpetstart);
+	printf("tsc: calibrated at %lu hz\n", frequency);
+	return frequency != 0;
+}
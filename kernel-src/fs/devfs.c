@@ -398,38 +398,49 @@ static int devfs_getdents(vnode_t *node, dent_t *buffer, size_t count, uintmax_t
 	return 0;
 }
 
-static int devfs_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int devfs_getpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	// only block devices will have this called
 	__assert(node->type == V_TYPE_BLKDEV);
-	iovec_t iovec = {
-		.addr = MAKE_HHDM(pmm_getpageaddress(page)),
-		.len = PAGE_SIZE
-	};
+	__assert(count <= VFS_PAGE_CLUSTER_MAX);
+	iovec_t iovec[VFS_PAGE_CLUSTER_MAX];
+	for (size_t i = 0; i < count; ++i) {
+		iovec[i].addr = MAKE_HHDM(pmm_getpageaddress(pages[i]));
+		iovec[i].len = PAGE_SIZE;
+	}
 
 	iovec_iterator_t iovec_iterator;
-	iovec_iterator_init(&iovec_iterator, &iovec, 1);
+	iovec_iterator_init(&iovec_iterator, iovec, count);
+
+	size_t size = count * PAGE_SIZE;
+	size_t readc = 0;
+	int error = VOP_READ(node, &iovec_iterator, size, offset, 0, &readc, NULL);
+	if (error)
+		return error;
 
-	size_t readc;
-	int error = VOP_READ(node, &iovec_iterator, PAGE_SIZE, offset, 0, &readc, NULL);
+	// the run can go past the end of the device, the pages there are zeroed
 	if (readc == 0)
 		return ENXIO;
+	else if (readc != size)
+		iovec_iterator_memset(&iovec_iterator, 0, size - readc);
 
-	return error;
+	return 0;
 }
 
-static int devfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int devfs_putpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	// only block devices will have this called
 	__assert(node->type == V_TYPE_BLKDEV);
-	iovec_t iovec = {
-		.addr = MAKE_HHDM(pmm_getpageaddress(page)),
-		.len = PAGE_SIZE
-	};
+	__assert(count <= VFS_PAGE_CLUSTER_MAX);
+	iovec_t iovec[VFS_PAGE_CLUSTER_MAX];
+	for (size_t i = 0; i < count; ++i) {
+		iovec[i].addr = MAKE_HHDM(pmm_getpageaddress(pages[i]));
+		iovec[i].len = PAGE_SIZE;
+	}
 
 	iovec_iterator_t iovec_iterator;
-	iovec_iterator_init(&iovec_iterator, &iovec, 1);
+	iovec_iterator_init(&iovec_iterator, iovec, count);
 
 	size_t writec;
-	int error = VOP_WRITE(node, &iovec_iterator, PAGE_SIZE, offset, 0, &writec, NULL);
+	int error = VOP_WRITE(node, &iovec_iterator, count * PAGE_SIZE, offset, 0, &writec, NULL);
 	__assert(writec != 0);
 
 	return error;
@@ -132,12 +132,29 @@ typedef struct {
 #define INODE_SECTSIZE 512
 #define EXT2NODE_INIT(vn, vop, f, t, v, i) \
 	VOP_INIT(&(vn)->vnode, vop, f, t, v); \
-	(vn)->id = i;
+	(vn)->id = i; \
+	memset((vn)->blockmap, 0, sizeof((vn)->blockmap)); \
+	(vn)->blockmapnext = 0;
+
+// logical blocks of an inode resolved through its indirect blocks are remembered in runs,
+// either of blocks contiguous on disk or of holes
+#define EXT2_BLOCKMAP_SIZE 8
+// most block pointers read from an indirect block at once to find a run
+#define EXT2_BLOCKMAP_READ 64
+
+typedef struct {
+	uintmax_t index; // first logical block of the run
+	uint32_t block; // block backing index, 0 for holes
+	size_t count; // 0 if the entry is unused
+} ext2blockrun_t;
 
 typedef struct {
 	vnode_t vnode;
 	inode_t inode;
 	int id;
+	// protected by the vnode lock like the inode
+	ext2blockrun_t blockmap[EXT2_BLOCKMAP_SIZE];
+	int blockmapnext; // entry replaced by the next run found
 } ext2node_t;
 
 typedef struct {
@@ -468,6 +485,69 @@ static int writeinode(ext2fs_t *fs, inode_t *buffer, int inode) {
 	return e;
 }
 
+static bool blockmapget(ext2node_t *node, uintmax_t index, blockptr_t *block) {
+	for (int i = 0; i < EXT2_BLOCKMAP_SIZE; ++i) {
+		ext2blockrun_t *run = &node->blockmap[i];
+		if (index >= run->index && index < run->index + run->count) {
+			*block = run->block ? run->block + (index - run->index) : 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// called before the block of index changes. the runs after it stay valid,
+// so a run starting at index is moved forward instead of being dropped
+static void blockmapinvalidate(ext2node_t *node, uintmax_t index) {
+	for (int i = 0; i < EXT2_BLOCKMAP_SIZE; ++i) {
+		ext2blockrun_t *run = &node->blockmap[i];
+		if (index < run->index || index >= run->index + run->count)
+			continue;
+
+		if (index == run->index) {
+			run->index += 1;
+			run->block += run->block ? 1 : 0;
+			run->count -= 1;
+		} else {
+			run->count = index - run->index;
+		}
+	}
+}
+
+// gets the block of index from slot in the singly indirect block singlyptr, reading the pointers
+// after it as well to remember the run starting at index
+static int readrun(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t singlyptr, size_t slot, blockptr_t *block) {
+	size_t count = BLOCKS_IN_INDIRECT(fs) - slot;
+	blockptr_t pointers[EXT2_BLOCKMAP_READ];
+
+	if (singlyptr) {
+		count = min(count, EXT2_BLOCKMAP_READ);
+		size_t readc;
+		int e = vfs_read(fs->backing, pointers, count * sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + slot * sizeof(blockptr_t), &readc, 0);
+		if (e)
+			return e;
+
+		size_t run = 1;
+		while (run < count && pointers[run] == (pointers[0] ? pointers[0] + run : 0))
+			++run;
+
+		count = run;
+	} else {
+		// the indirect block isn't allocated, everything it would point to is a hole
+		pointers[0] = 0;
+	}
+
+	ext2blockrun_t *run = &node->blockmap[node->blockmapnext];
+	node->blockmapnext = (node->blockmapnext + 1) % EXT2_BLOCKMAP_SIZE;
+	run->index = index;
+	run->block = pointers[0];
+	run->count = count;
+
+	*block = pointers[0];
+	return 0;
+}
+
 static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t *block) {
 	// no indirection needed
 	if (index < 12) {
@@ -475,18 +555,19 @@ static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 		return 0;
 	}
 
+	if (blockmapget(node, index, block))
+		return 0;
+
+	uintmax_t logical = index;
 	index -= 12;
 
 	size_t blocksinindirect = BLOCKS_IN_INDIRECT(fs);
 	int singlyidx = index % blocksinindirect;
-	uintmax_t singlyoffset = singlyidx * sizeof(blockptr_t);
 	int singly = index / blocksinindirect;
 
 	// first singly indirect block
-	if (singly == 0) {
-		size_t readc;
-		return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.singlypointer) + singlyoffset, &readc, 0);
-	}
+	if (singly == 0)
+		return readrun(fs, node, logical, node->inode.singlypointer, singlyidx, block);
 
 	singly -= 1;
 	int doublyidx = singly % blocksinindirect;
@@ -496,11 +577,14 @@ static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 	// first doubly indirect block
 	if (doubly == 0) {
 		size_t readc;
-		blockptr_t singlyptr;
-		int e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.doublypointer) + doublyoffset, &readc, 0);
-		if (e)
-			return e;
-		return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + singlyoffset, &readc, 0);
+		blockptr_t singlyptr = 0;
+		if (node->inode.doublypointer) {
+			int e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.doublypointer) + doublyoffset, &readc, 0);
+			if (e)
+				return e;
+		}
+
+		return readrun(fs, node, logical, singlyptr, singlyidx, block);
 	}
 
 	doubly -= 1;
@@ -509,17 +593,21 @@ static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 
 	// triply indirect block
 	size_t readc;
-	blockptr_t doublyptr;
-	blockptr_t singlyptr;
-	int e = vfs_read(fs->backing, &doublyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.triplypointer) + triplyoffset, &readc, 0);
-	if (e)
-		return e;
+	blockptr_t doublyptr = 0;
+	blockptr_t singlyptr = 0;
+	if (node->inode.triplypointer) {
+		int e = vfs_read(fs->backing, &doublyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.triplypointer) + triplyoffset, &readc, 0);
+		if (e)
+			return e;
+	}
 
-	e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, doublyptr) + doublyoffset, &readc, 0);
-	if (e)
-		return e;
+	if (doublyptr) {
+		int e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, doublyptr) + doublyoffset, &readc, 0);
+		if (e)
+			return e;
+	}
 
-	return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + singlyoffset, &readc, 0);
+	return readrun(fs, node, logical, singlyptr, singlyidx, block);
 }
 
 static int allocandset(ext2fs_t *fs, ext2node_t *node, uintmax_t setoffset, blockptr_t *newvalue) {
@@ -573,6 +661,8 @@ static int inodeallocateindirect(ext2fs_t *fs, ext2node_t *node, int indirect) {
 }
 
 static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t block) {
+	blockmapinvalidate(node, index);
+
 	// no indirection needed
 	size_t blocksinindirect = BLOCKS_IN_INDIRECT(fs);
 	bool usedirect = index < 12;
@@ -749,61 +839,97 @@ static int resizeinode(ext2fs_t *fs, ext2node_t *node, size_t newsize) {
 	return 0;
 }
 
-static int rwblocks_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t index, bool write, bool cache) {
-	for (uintmax_t i = 0; i < count; ++i) {
-		size_t inodesize = INODE_SIZE(&node->inode);
-		__assert(index + i < ROUND_UP(inodesize, fs->blocksize) / fs->blocksize);
+// does I/O on the backing device through its page cache
+static int rwbuffered(ext2fs_t *fs, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t diskoffset, bool write, int flags) {
+	size_t donecount;
+	int e = write ?
+		vfs_write_iovec(fs->backing, iovec_iterator, size, diskoffset, &donecount, flags) :
+		vfs_read_iovec(fs->backing, iovec_iterator, size, diskoffset, &donecount, flags, NULL);
+
+	if (e)
+		return e;
+
+	__assert(donecount == size);
+	return 0;
+}
+
+// does I/O on the backing device directly, without going through its page cache
+static int rwdirect(ext2fs_t *fs, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t diskoffset, bool write) {
+	size_t donecount;
+	VOP_LOCK(fs->backing);
+	int e = write ?
+		VOP_WRITE(fs->backing, iovec_iterator, size, diskoffset, 0, &donecount, NULL) :
+		VOP_READ(fs->backing, iovec_iterator, size, diskoffset, 0, &donecount, NULL);
+	VOP_UNLOCK(fs->backing);
+
+	if (e)
+		return e;
+
+	__assert(donecount == size);
+	return 0;
+}
 
-		blockptr_t block;
-		int e = getinodeblock(fs, node, index + i, &block);
+// file data (cache == false) is cached by the file vnode already, so it is moved directly between the file pages
+// and the device instead of being cached and copied a second time by the backing device.
+// the parts of the range in device pages that are shared with other blocks or that the device has cached
+// still go through its cache, so it never holds a stale copy of file data that could be written back over it later
+static int rwbacking(ext2fs_t *fs, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t diskoffset, bool write, bool cache) {
+	if (cache)
+		return rwbuffered(fs, iovec_iterator, size, diskoffset, write, 0);
+
+	uintmax_t end = diskoffset + size;
+	uintmax_t pagestart = ROUND_UP(diskoffset, PAGE_SIZE);
+	uintmax_t pageend = ROUND_DOWN(end, PAGE_SIZE);
+
+	// no whole device page in the range
+	if (pagestart >= pageend)
+		return rwbuffered(fs, iovec_iterator, size, diskoffset, write, V_FFLAGS_NOCACHE);
+
+	int e;
+	if (pagestart > diskoffset) {
+		e = rwbuffered(fs, iovec_iterator, pagestart - diskoffset, diskoffset, write, V_FFLAGS_NOCACHE);
 		if (e)
 			return e;
+	}
 
-		// for sparse files
-		if (block == 0 && write) {
-			uintmax_t newblock;
-			e = allocatestructure(fs, &newblock, false);
-			if (e)
-				return e;
+	uintmax_t directstart = pagestart;
+	for (uintmax_t offset = pagestart; offset < pageend; offset += PAGE_SIZE) {
+		if (vmmcache_iscached(fs->backing, offset) == false)
+			continue;
 
-			e = setinodeblock(fs, node, index + i, newblock);
-			if (e) {
-				freestructure(fs, newblock, false);
+		if (offset > directstart) {
+			e = rwdirect(fs, iovec_iterator, offset - directstart, directstart, write);
+			if (e)
 				return e;
-			}
-
-			block = newblock;
-		} else if (block == 0 && write == false) {
-			iovec_iterator_memset(iovec_iterator, 0, fs->blocksize);
-			continue;
 		}
 
-		size_t donecount;
-		e = write ?
-			vfs_write_iovec(fs->backing, iovec_iterator, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
-			vfs_read_iovec(fs->backing, iovec_iterator, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
-
+		e = rwbuffered(fs, iovec_iterator, PAGE_SIZE, offset, write, V_FFLAGS_NOCACHE);
 		if (e)
 			return e;
 
-		__assert(donecount == fs->blocksize);
+		directstart = offset + PAGE_SIZE;
+	}
+
+	if (pageend > directstart) {
+		e = rwdirect(fs, iovec_iterator, pageend - directstart, directstart, write);
+		if (e)
+			return e;
 	}
+
+	if (end > pageend)
+		return rwbuffered(fs, iovec_iterator, end - pageend, pageend, write, V_FFLAGS_NOCACHE);
+
 	return 0;
 }
 
-static int rwblock_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, uintmax_t index, bool write, bool cache) {
-	__assert(offset + count <= fs->blocksize);
-	size_t inodesize = INODE_SIZE(&node->inode);
-	__assert(index < ROUND_UP(inodesize, fs->blocksize) / fs->blocksize);
-
-	blockptr_t block;
-	int e = getinodeblock(fs, node, index, &block);
+// gets the block backing index in the inode. if write is true, a block is allocated for holes
+static int mapblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, bool write, blockptr_t *block) {
+	int e = getinodeblock(fs, node, index, block);
 	if (e)
 		return e;
 
-
 	// for sparse files
-	if (block == 0 && write) {
+	if (*block == 0 && write) {
 		uintmax_t newblock;
 		e = allocatestructure(fs, &newblock, false);
 		if (e)
@@ -815,22 +941,69 @@ static int rwblock_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec
 			return e;
 		}
 
-		block = newblock;
-	} else if (block == 0 && write == false) {
-		iovec_iterator_memset(iovec_iterator, 0, count);
-		return 0;
+		*block = newblock;
 	}
 
-	size_t donecount;
-	e = write ?
-		vfs_write_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
-		vfs_read_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
+	return 0;
+}
+
+// blocks that are contiguous on disk are done in a single request to the backing device
+static int rwblocks_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t index, bool write, bool cache) {
+	size_t inodesize = INODE_SIZE(&node->inode);
+	__assert(index + count <= ROUND_UP(inodesize, fs->blocksize) / fs->blocksize);
 
+	blockptr_t block;
+	int e = count ? mapblock(fs, node, index, write, &block) : 0;
 	if (e)
 		return e;
 
-	__assert(donecount == count);
-	return e;
+	for (uintmax_t i = 0; i < count;) {
+		// extend the run over the blocks that follow it on disk
+		blockptr_t next = 0;
+		size_t run = 1;
+		while (i + run < count) {
+			e = mapblock(fs, node, index + i + run, write, &next);
+			if (e)
+				return e;
+
+			if (block == 0 || next != block + run)
+				break;
+
+			++run;
+		}
+
+		if (block == 0) {
+			// hole in a sparse file
+			iovec_iterator_memset(iovec_iterator, 0, fs->blocksize);
+		} else {
+			e = rwbacking(fs, iovec_iterator, run * fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), write, cache);
+			if (e)
+				return e;
+		}
+
+		i += run;
+		block = next;
+	}
+	return 0;
+}
+
+static int rwblock_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, uintmax_t index, bool write, bool cache) {
+	__assert(offset + count <= fs->blocksize);
+	size_t inodesize = INODE_SIZE(&node->inode);
+	__assert(index < ROUND_UP(inodesize, fs->blocksize) / fs->blocksize);
+
+	blockptr_t block;
+	int e = mapblock(fs, node, index, write, &block);
+	if (e)
+		return e;
+
+	// hole in a sparse file
+	if (block == 0) {
+		iovec_iterator_memset(iovec_iterator, 0, count);
+		return 0;
+	}
+
+	return rwbacking(fs, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, write, cache);
 }
 
 static int rwbytes_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, bool write, bool cache) {
@@ -1697,51 +1870,61 @@ static int ext2_unlink(vnode_t *vnode, vnode_t *child, char *name, cred_t *cred)
 	return err;
 }
 
-static int ext2_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int ext2_getpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	// only regular files get cached
 	__assert(node->type == V_TYPE_REGULAR);
-	size_t readc = PAGE_SIZE;
-	void *addr = MAKE_HHDM(pmm_getpageaddress(page));
-
-	iovec_t iovec = {
-		.addr = addr,
-		.len = PAGE_SIZE
-	};
+	__assert(count <= VFS_PAGE_CLUSTER_MAX);
+	size_t size = count * PAGE_SIZE;
+	size_t readc = size;
+
+	iovec_t iovec[VFS_PAGE_CLUSTER_MAX];
+	for (size_t i = 0; i < count; ++i) {
+		iovec[i].addr = MAKE_HHDM(pmm_getpageaddress(pages[i]));
+		iovec[i].len = PAGE_SIZE;
+	}
 
 	iovec_iterator_t iovec_iterator;
-	iovec_iterator_init(&iovec_iterator, &iovec, 1);
-	int error = VOP_READ(node, &iovec_iterator, PAGE_SIZE, offset, 0, &readc, NULL);
+	iovec_iterator_init(&iovec_iterator, iovec, count);
+	int error = VOP_READ(node, &iovec_iterator, size, offset, 0, &readc, NULL);
+	if (error)
+		return error;
+
 	if (readc == 0)
 		return ENXIO;
-	else if (readc != PAGE_SIZE)
-		memset((void *)((uintptr_t)addr + readc), 0, PAGE_SIZE - readc);
+	else if (readc != size)
+		iovec_iterator_memset(&iovec_iterator, 0, size - readc);
 
-	return error;
+	return 0;
 }
 
-static int ext2_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int ext2_putpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	// only regular files get cached
 	__assert(node->type == V_TYPE_REGULAR);
+	__assert(count <= VFS_PAGE_CLUSTER_MAX);
+	size_t size = count * PAGE_SIZE;
 	size_t writec;
-	iovec_t iovec = {
-		.addr = MAKE_HHDM(pmm_getpageaddress(page)),
-		.len = PAGE_SIZE
-	};
+
+	iovec_t iovec[VFS_PAGE_CLUSTER_MAX];
+	for (size_t i = 0; i < count; ++i) {
+		iovec[i].addr = MAKE_HHDM(pmm_getpageaddress(pages[i]));
+		iovec[i].len = PAGE_SIZE;
+	}
 
 	iovec_iterator_t iovec_iterator;
-	iovec_iterator_init(&iovec_iterator, &iovec, 1);
-	int error = VOP_WRITE(node, &iovec_iterator, PAGE_SIZE, offset, 0, &writec, NULL);
+	iovec_iterator_init(&iovec_iterator, iovec, count);
+	int error = VOP_WRITE(node, &iovec_iterator, size, offset, 0, &writec, NULL);
 
-	// its possible that writec is zero here. the condition where this is possible is when
+	// its possible that not all pages were written here. the condition where this is possible is when
 	// the file is truncated after the check in the page sync function but before it actually is
-	// written back to disk. therefore, we check that the page IS infact truncated if this happens.
-	// if it isn't, something else happened and its not safe to continue.
+	// written back to disk. therefore, we check that the pages that weren't written ARE infact truncated.
+	// if they aren't, something else happened and its not safe to continue.
 	//
 	// TODO: since this check will likely be copied between different filesystem drivers, it could be interesting to have
 	// ext2_putpage take in a (size_t *) pointer and have this check be in whatever function calls VOP_PUTPAGE.
 
-	if (writec == 0) {
-		__assert(page->flags & PAGE_FLAGS_TRUNCATED);
+	if (error == 0) {
+		for (size_t i = ROUND_UP(writec, PAGE_SIZE) / PAGE_SIZE; i < count; ++i)
+			__assert(pages[i]->flags & PAGE_FLAGS_TRUNCATED);
 	}
 
 	return error;
@@ -19,6 +19,7 @@ static void ctor(scache_t *cache, void *obj) {
 	MUTEX_INIT(&file->mutex);
 	file->refcount = 1;
 	file->offset = 0;
+	file->readahead = (vfsreadahead_t){0};
 }
 
 static file_t* newfile() {
@@ -471,9 +471,11 @@ static int tmpfs_resize(vnode_t *node, size_t size, cred_t *) {
 	return 0;
 }
 
-static int tmpfs_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int tmpfs_getpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	int error = 0;
 
+	// as with a short read on other filesystems, only a run starting past the end of the file fails.
+	// pages of the run past the end are zeroed and pinned like the others, so they stay valid if the file grows
 	tmpfsnode_t *tmpfsnode = (tmpfsnode_t *)node;
 	if (offset >= tmpfsnode->attr.size)
 		error = ENXIO;
@@ -482,17 +484,19 @@ static int tmpfs_getpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 		return error;
 
 	// since tmpfs files now store their data on the vmmcache,
-	// all getpage will do will be set the page to 0 and pin it in memory
-	void *phy = pmm_getpageaddress(page);
-	void *phyhhdm = MAKE_HHDM(phy);
-
-	pmm_hold(phy);
-	page->flags |= PAGE_FLAGS_PINNED;
-	memset(phyhhdm, 0, PAGE_SIZE);
+	// all getpage will do will be set the pages to 0 and pin them in memory
+	for (size_t i = 0; i < count; ++i) {
+		void *phy = pmm_getpageaddress(pages[i]);
+		void *phyhhdm = MAKE_HHDM(phy);
+
+		pmm_hold(phy);
+		pages[i]->flags |= PAGE_FLAGS_PINNED;
+		memset(phyhhdm, 0, PAGE_SIZE);
+	}
 	return 0;
 }
 
-static int tmpfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
+static int tmpfs_putpage(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count) {
 	// putpage is a no-op on tmpfs
 	return 0;
 }
@@ -231,6 +231,7 @@ static int writenocache(vnode_t *node, page_t *page, uintmax_t pageoffset) {
 
 int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *written, int flags) {
 	int err = 0;
+	void *bounce = NULL;
 	if (vfs_iscacheable(node)) {
 		*written = 0;
 		// can't write a size 0 buffer
@@ -282,6 +283,7 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 		bytestopages(offset, size, &pageoffset, &pagecount, &startoffset);
 		page_t *page = NULL;
 
+		// only a partial first or last page is read from the disk, the pages in between are overwritten whole
 		if (startoffset) {
 			// unaligned first page
 			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE, &page);
@@ -312,17 +314,44 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 
 		for (uintmax_t offset = 0; offset < pagecount * PAGE_SIZE; offset += PAGE_SIZE) {
 			// the other pages
-			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE + offset, &page);
+			size_t writesize = min(PAGE_SIZE, size - *written);
+			bool fill = false;
+			if (writesize == PAGE_SIZE) {
+				// whole pages are copied into a bounce buffer before getting the page, as one that isn't cached
+				// stays not ready until it's filled. if the source is a mapping of that same page, faulting on it
+				// during the copy would wait for it forever
+				if (bounce == NULL) {
+					bounce = alloc(PAGE_SIZE);
+					if (bounce == NULL) {
+						err = ENOMEM;
+						goto leave;
+					}
+				}
+
+				err = iovec_iterator_copy_to_buffer(iovec_iterator, bounce, PAGE_SIZE);
+				if (err)
+					goto leave;
+
+				err = vmmcache_getpagetofill(node, pageoffset * PAGE_SIZE + offset, &page, &fill);
+			} else {
+				err = vmmcache_getpage(node, pageoffset * PAGE_SIZE + offset, &page);
+			}
+
 			if (err)
 				goto leave;
 
-			size_t writesize = min(PAGE_SIZE, size - *written);
 			void *address = MAKE_HHDM(pmm_getpageaddress(page));
 
-			err = iovec_iterator_copy_to_buffer(iovec_iterator, address, writesize);
-			if (err) {
-				pmm_release(FROM_HHDM(address));
-				goto leave;
+			if (writesize == PAGE_SIZE) {
+				memcpy(address, bounce, PAGE_SIZE);
+				if (fill)
+					vmmcache_endfill(page);
+			} else {
+				err = iovec_iterator_copy_to_buffer(iovec_iterator, address, writesize);
+				if (err) {
+					pmm_release(FROM_HHDM(address));
+					goto leave;
+				}
 			}
 
 			vmmcache_makedirty(page);
@@ -338,6 +367,9 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 		}
 
 		leave:
+		if (bounce)
+			free(bounce);
+
 		MUTEX_RELEASE(&node->size_lock);
 	} else {
 		// special file, just write as its not being cached
@@ -349,7 +381,7 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 	return err;
 }
 
-int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags) {
+int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags, vfsreadahead_t *readahead) {
 	int err = 0;
 	if (vfs_iscacheable(node)) {
 		*bytesread = 0;
@@ -392,10 +424,18 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 
 		size = min(size + offset, nodesize) - offset;
 
+		// start reading the following pages in the background if the file is being read sequentially
+		if (readahead && (flags & V_FFLAGS_NOCACHE) == 0)
+			vmmcache_readahead(node, readahead, offset, size, nodesize);
+
 		uintmax_t pageoffset, pagecount, startoffset;
 		bytestopages(offset, size, &pageoffset, &pagecount, &startoffset);
 		page_t *page = NULL;
 
+		// read in the missing pages of the range together instead of one by one
+		if (pagecount > 1)
+			vmmcache_pagein(node, pageoffset * PAGE_SIZE, pagecount * PAGE_SIZE);
+
 		if (startoffset) {
 			// unaligned first page
 			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE, &page);
@@ -477,7 +517,7 @@ int vfs_read(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t
 	iovec_iterator_t iovec_iterator;
 	iovec_iterator_init(&iovec_iterator, &iovec, 1);
 
-	return vfs_read_iovec(node, &iovec_iterator, size, offset, bytes_read, flags);
+	return vfs_read_iovec(node, &iovec_iterator, size, offset, bytes_read, flags, NULL);
 }
 
 // if type is V_TYPE_LINK, a symlink is made
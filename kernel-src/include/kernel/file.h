@@ -12,6 +12,7 @@ typedef struct file_t {
 	mode_t mode;
 	uintmax_t offset;
 	int flags;
+	vfsreadahead_t readahead;
 } file_t;
 
 typedef struct fd_t {
@@ -5,13 +5,15 @@
 #include <kernel/timer.h>
 
 typedef struct {
-	struct cpu_t *cpu;
+	struct cpu_t *cpu; // cpu the entry was last armed on
 	timerentry_t entry;
+	uintmax_t deadline; // ns from boot
 	uintmax_t remainingus;
 	uintmax_t repeatus;
 	dpcfn_t fn;
 	dpcarg_t arg;
 	bool paused;
+	bool firing; // the entry fired but its dpc hasn't run yet
 	spinlock_t lock;
 } itimer_t;
 
@@ -0,0 +1,23 @@
+#ifndef _KSTAT_H
+#define _KSTAT_H
+
+#include <stddef.h>
+
+// /dev/kstat prints the statistics kept by the kernel subsystems as text, one "name: values" per line.
+// each subsystem registers a function which prints its own statistics with kstat_printf
+
+#define KSTAT_MAX_PROVIDERS 16
+
+typedef struct {
+	char *buffer;
+	size_t size;
+	size_t offset; // might be past size, then the output was cut short
+} kstatbuffer_t;
+
+typedef void (*kstatprovider_t)(kstatbuffer_t *buffer);
+
+void kstat_register(kstatprovider_t provider);
+void kstat_printf(kstatbuffer_t *buffer, const char *format, ...);
+void kstat_init();
+
+#endif
@@ -15,14 +15,24 @@
 #define PAGE_FLAGS_DIRTY 8
 #define PAGE_FLAGS_READY 16
 #define PAGE_FLAGS_ERROR 32
+#define PAGE_FLAGS_CPUCACHED 64
+#define PAGE_FLAGS_LARGEALLOC 128
+#define PAGE_FLAGS_READAHEAD 256
+
+// contiguous allocations are served by a buddy allocator with blocks of up to 2^PMM_MAX_ORDER pages
+#define PMM_MAX_ORDER 10
+
+// free anonymous pages kept per cpu so single page allocations and releases don't need the freelist mutex
+#define PMM_CPUCACHE_SIZE 64
+#define PMM_CPUCACHE_BATCH 32
 
 typedef struct page_t {
 	struct vnode_t *backing;
-	uintmax_t offset;
-	struct page_t *hashnext;
-	struct page_t *hashprev;
-	struct page_t *vnodenext;
-	struct page_t *vnodeprev;
+	union {
+		uintmax_t offset;
+		struct slab_t *slab; // slab owning the page, for pages holding slab objects
+		size_t allocsize; // for the first page of large alloc() allocations
+	};
 	union {
 		struct {
 			struct page_t *freenext;
@@ -35,17 +45,30 @@ typedef struct page_t {
 	};
 	uintmax_t refcount;
 	int flags;
+	int order;
 } page_t;
 
+typedef struct {
+	struct page_t *pages[PMM_CPUCACHE_SIZE];
+	size_t count;
+	uintmax_t hits;
+	uintmax_t misses;
+	uintmax_t refills;
+	uintmax_t drains;
+} pmmcpucache_t;
+
 void *pmm_allocpage(int section);
+void *pmm_allocpagezeroed(int section);
 page_t *pmm_getpage(void *addr);
 void *pmm_getpageaddress(page_t *);
 void pmm_hold(void *addr);
+void pmm_holdmany(void **addrs, size_t count);
 void pmm_release(void *addr);
 void pmm_makefree(void *address, size_t count);
 void *pmm_alloc(size_t size, int section);
 void pmm_free(void *addr, size_t size);
 void pmm_init();
+void pmm_zeropoolinit();
 
 extern uintptr_t hhdmbase;
 
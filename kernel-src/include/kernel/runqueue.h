@@ -0,0 +1,25 @@
+#ifndef _RUNQUEUE_H
+#define _RUNQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <spinlock.h>
+
+#define SCHED_PRIORITY_COUNT 64
+
+struct thread_t;
+
+typedef struct {
+	struct thread_t *list;
+	struct thread_t *last;
+} schedqueue_t;
+
+// per cpu run queue, bit n of bitmap is set if the list of priority n isn't empty
+typedef struct {
+	spinlock_t lock;
+	uint64_t bitmap;
+	size_t count;
+	schedqueue_t queues[SCHED_PRIORITY_COUNT];
+} schedrunqueue_t;
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <kernel/proc.h>
 #include <kernel/thread.h>
+#include <kernel/runqueue.h>
 
 #define SCHED_WAKEUP_REASON_NORMAL 0
 #define SCHED_WAKEUP_REASON_INTERRUPTED -1
@@ -15,6 +16,7 @@ void sched_ap_entry();
 
 void sched_queue(thread_t *thread);
 bool sched_wakeup(thread_t *thread, int reason);
+void sched_kick(thread_t *thread);
 
 void sched_stop_current_thread();
 void sched_prepare_sleep(bool interruptible);
@@ -8,12 +8,53 @@
 typedef struct slab_t {
 	struct slab_t *next;
 	struct slab_t *prev;
+	struct scache_t *cache;
 	size_t used;
 	void **free;
 	void *base;
 } slab_t;
 
+#define SLAB_MAGAZINE_SIZE 15
+#define SLAB_DEPOT_MAXFULL 8
+
+#define SLAB_FLAGS_NOMAGAZINE 1
+
+// per cpu object caching as described by Bonwick and Adams in "Magazines and Vmem".
+// each cpu has a loaded and a previous magazine of free objects which are used without any locking,
+// and magazines are exchanged with a per cache depot when both are full or empty.
+// when memory runs low, the magazines of every cpu and the depots are given back to the slabs
+typedef struct slabmagazine_t {
+	struct slabmagazine_t *next;
+	size_t count;
+	void *objects[SLAB_MAGAZINE_SIZE];
+} slabmagazine_t;
+
+typedef struct {
+	slabmagazine_t *loaded;
+	slabmagazine_t *previous;
+	uintmax_t allochits;
+	uintmax_t allocmisses;
+	uintmax_t freehits;
+	uintmax_t freemisses;
+} slabcpu_t;
+
+typedef struct {
+	uintmax_t allochits;
+	uintmax_t allocmisses;
+	uintmax_t freehits;
+	uintmax_t freemisses;
+	uintmax_t depotexchanges;
+	uintmax_t depotflushes;
+	size_t depotfull;
+	size_t depotempty;
+	size_t slabs;
+	size_t objects;
+	size_t usedobjects;
+	size_t cachedobjects;
+} slabstats_t;
+
 typedef struct scache_t {
+	struct scache_t *next; // in the list of all caches
 	mutex_t mutex;
 	void (*ctor)(struct scache_t *cache, void *obj);
 	void (*dtor)(struct scache_t *cache, void *obj);
@@ -24,11 +65,26 @@ typedef struct scache_t {
 	size_t truesize;
 	size_t alignment;
 	size_t slabobjcount;
+	size_t slabcount;
+	int flags;
+	spinlock_t depotlock;
+	slabmagazine_t *depotfull;
+	slabmagazine_t *depotempty;
+	size_t depotfullcount;
+	size_t depotemptycount;
+	uintmax_t depotexchanges;
+	uintmax_t depotflushes;
+	slabcpu_t *cpu; // indexed by cpu number, NULL with SLAB_FLAGS_NOMAGAZINE
+	size_t cpucount;
 } scache_t;
 
 void *slab_allocate(scache_t *cache);
 void slab_free(scache_t *cache, void *addr);
 scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *, void *), void (*dtor)(scache_t *, void *));
 void slab_freecache(scache_t *cache);
+void slab_getstats(scache_t *cache, slabstats_t *stats);
+scache_t *slab_getcache(void *obj);
+void slab_lowmemory();
+void slab_reclaiminit();
 
 #endif
@@ -37,6 +37,9 @@ typedef struct thread_t {
 	bool sleepintstatus;
 	spinlock_t sleeplock;
 	int wakeupreason;
+#ifdef SCHED_WAKEUP_STATS
+	uintmax_t queuedns; // when sched_queue was last called on the thread, for the wakeup latency statistics
+#endif
 	bool shouldexit;
 	void *kernelarg;
 	context_t *usercopyctx;
@@ -2,8 +2,26 @@
 #define _TIMEKEEPER_H
 
 #include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
 
-void timekeeper_init(time_t (*tick)(), time_t ticksperus);
+// read only page mapped into every process, so the clocks can be read without a syscall.
+// the nanoseconds since boot are ((ticks - initticks) * mult) >> shift, with the ticks read by rdtsc.
+// if TIMEKEEPER_PAGE_FLAGS_TSC isn't set the clock can't be read from userspace.
+// it is right below INTERP_BASE
+#define TIMEKEEPER_PAGE_BASE (void *)0x00000beeeffff000
+#define TIMEKEEPER_PAGE_FLAGS_TSC 1
+
+typedef struct {
+	uint64_t flags;
+	uint64_t initticks;
+	uint64_t mult;
+	uint64_t shift;
+	int64_t bootunix;
+} timekeeperpage_t;
+
+void timekeeper_init(time_t (*tick)(), uint64_t frequency, bool usertsc);
+int timekeeper_mapuserpage();
 timespec_t timekeeper_timefromboot();
 timespec_t timekeeper_time();
 
@@ -5,15 +5,27 @@
 #include <arch/context.h>
 #include <spinlock.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <kernel/dpc.h>
 
+// hierarchical timing wheel. level 0 has one slot per wheel unit (about a microsecond),
+// every level above has slots TIMER_WHEEL_SLOTS times as wide as the one below it
+#define TIMER_WHEEL_LEVELS 8
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+// entries too far into the future for the highest level
+#define TIMER_WHEEL_OVERFLOW TIMER_WHEEL_LEVELS
+
 typedef struct timerentry_t {
 	struct timerentry_t *next;
+	struct timerentry_t **pprev; // NULL if not in the wheel
 	time_t absolutetick;
 	time_t repeatus;
 	dpcfn_t fn;
 	dpcarg_t arg;
 	dpc_t dpc;
+	int level;
+	int slot;
 	bool fired;
 } timerentry_t;
 
@@ -26,7 +38,12 @@ typedef struct {
 	bool running;
 	void (*arm)(time_t);
 	time_t (*stop)();
-	timerentry_t *queue;
+	int unitshift; // log2 of the ticks in a wheel unit
+	uint64_t wheelbase; // wheel unit the wheel was last advanced to
+	uint64_t bitmap[TIMER_WHEEL_LEVELS]; // non empty slots
+	timerentry_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	timerentry_t *overflow;
+	size_t count;
 } timer_t;
 
 void timer_resume(timer_t *timer);
@@ -34,6 +51,7 @@ void timer_stop(timer_t *timer);
 void timer_isr(timer_t *timer, context_t *context);
 void timer_insert(timer_t *timer, timerentry_t *entry, dpcfn_t fn, dpcarg_t arg, time_t us, bool repeating);
 uintmax_t timer_remove(timer_t *timer, timerentry_t *entry);
+bool timer_cancel(timer_t *timer, timerentry_t *entry);
 timer_t *timer_new(time_t ticksperus, void (*arm)(time_t), time_t (*stop)(), time_t tick_limit);
 
 #endif
@@ -9,6 +9,7 @@
 #include <time.h>
 #include <errno.h>
 #include <kernel/cred.h>
+#include <radixtree.h>
 
 #define V_ATTR_MODE	1
 #define V_ATTR_UID	2
@@ -89,6 +90,15 @@ typedef struct vfs_t {
 #define V_FFLAGS_NOCTTY 32
 #define V_FFLAGS_NOCACHE 64
 
+struct page_t;
+
+// sequential access state of an open file, used to read ahead of the reader
+typedef struct {
+	uintmax_t lastpage; // last page touched by the previous read
+	uintmax_t nextpage; // first page not yet submitted for readahead
+	size_t window; // pages read ahead of the reader, 0 if the access isn't sequential
+} vfsreadahead_t;
+
 typedef struct vnode_t {
 	struct vops_t *ops;
 	mutex_t lock;
@@ -103,7 +113,9 @@ typedef struct vnode_t {
 		void *fifobinding;
 	};
 
-	struct page_t *pages;
+	// page cache of the vnode, indexed by page number
+	radixtree_t pages;
+	mutex_t pageslock;
 } vnode_t;
 
 typedef struct vfsops_t {
@@ -139,8 +151,8 @@ typedef struct vops_t {
 	int (*maxseek)(vnode_t *node, size_t *max);
 	int (*resize)(vnode_t *node, size_t newsize, cred_t *cred);
 	int (*rename)(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode_t *targetdir, vnode_t *target, char *newname, int flags);
-	int (*getpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
-	int (*putpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
+	int (*getpage)(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count);
+	int (*putpage)(vnode_t *node, uintmax_t offset, struct page_t **pages, size_t count);
 	int (*sync)(vnode_t *node);
 	int (*lock)(vnode_t *node);
 	int (*unlock)(vnode_t *node);
@@ -162,6 +174,7 @@ typedef struct vops_t {
 	(vn)->ops = o; \
 	MUTEX_INIT(&(vn)->lock); \
 	MUTEX_INIT(&(vn)->size_lock); \
+	MUTEX_INIT(&(vn)->pageslock); \
 	(vn)->refcount = 1; \
 	(vn)->flags = f; \
 	(vn)->type = t; \
@@ -173,6 +186,9 @@ typedef struct vops_t {
 
 #define VOP_MMAP_ADDRESS_MMAP_SUPPORTED (void *)-1
 
+// most pages passed to a single VOP_GETPAGE or VOP_PUTPAGE
+#define VFS_PAGE_CLUSTER_MAX 32
+
 #define VOP_OPEN(v, f, c) (*v)->ops->open(v, f, c)
 #define VOP_CLOSE(v, f, c) (v)->ops->close(v, f, c)
 #define VOP_READ(v, b, s, o, f, r, c) (v)->ops->read(v, b, s, o, f, r, c)
@@ -195,8 +211,9 @@ typedef struct vops_t {
 #define VOP_MAXSEEK(v, rp) ((v)->ops->maxseek ? (v)->ops->maxseek(v, rp) : ENOTTY)
 #define VOP_RESIZE(v, s, c) (v)->ops->resize(v, s, c)
 #define VOP_RENAME(sd, s, o, td, t, n, f) (s)->ops->rename(sd, s, o, td, t, n, f)
-#define VOP_GETPAGE(v, o, p) (v)->ops->getpage(v, o, p)
-#define VOP_PUTPAGE(v, o, p) (v)->ops->putpage(v, o, p)
+// getpage and putpage take a run of count pages backing the file from offset onwards
+#define VOP_GETPAGE(v, o, p, c) (v)->ops->getpage(v, o, p, c)
+#define VOP_PUTPAGE(v, o, p, c) (v)->ops->putpage(v, o, p, c)
 #define VOP_SYNC(v) (v)->ops->sync(v)
 #define VOP_HOLD(v) __atomic_add_fetch(&(v)->refcount, 1, __ATOMIC_SEQ_CST)
 #define VOP_RELEASE(v) {\
@@ -215,7 +232,7 @@ int vfs_register(vfsops_t *vfsops, char *name);
 int vfs_open(vnode_t *ref, char *path, int flags, vnode_t **result);
 int vfs_close(vnode_t *node, int flags);
 int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *written, int flags);
-int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags);
+int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags, vfsreadahead_t *readahead);
 int vfs_write(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t *written, int flags);
 int vfs_read(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t *bytesread, int flags);
 int vfs_create(vnode_t *ref, char *path, vattr_t *attr, int type, vnode_t **node);
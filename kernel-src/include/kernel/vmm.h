@@ -3,6 +3,7 @@
 
 #include <arch/mmu.h>
 #include <mutex.h>
+#include <rwlock.h>
 #include <kernel/vfs.h>
 
 #define VMM_FLAGS_PAGESIZE 1
@@ -13,8 +14,10 @@
 #define VMM_FLAGS_SHARED  32
 #define VMM_FLAGS_REPLACE 64
 #define VMM_FLAGS_CREDCHECK 128
+#define VMM_FLAGS_POPULATE 256
+#define VMM_FLAGS_READONLY 512 // can't be made writable by userspace
 
-#define VMM_PERMANENT_FLAGS_MASK (VMM_FLAGS_FILE | VMM_FLAGS_SHARED | VMM_FLAGS_PHYSICAL)
+#define VMM_PERMANENT_FLAGS_MASK (VMM_FLAGS_FILE | VMM_FLAGS_SHARED | VMM_FLAGS_PHYSICAL | VMM_FLAGS_READONLY)
 
 #define VMM_ACTION_READ 1
 #define VMM_ACTION_WRITE 2
@@ -26,9 +29,17 @@ typedef struct {
 } vmmfiledesc_t;
 
 struct vmmcache_t;
+// ranges are kept both in a sorted doubly linked list and in an AVL tree keyed by start.
+// each node also tracks the free gap before it and the biggest such gap in its subtree
 typedef struct vmmrange_t{
 	struct vmmrange_t *next;
 	struct vmmrange_t *prev;
+	struct vmmrange_t *left;
+	struct vmmrange_t *right;
+	struct vmmrange_t *parent;
+	int height;
+	size_t gap;
+	size_t maxgap;
 	void *start;
 	size_t size;
 	int flags;
@@ -55,9 +66,16 @@ typedef struct vmmcache_t {
 	vmmrange_t ranges[VMM_RANGES_PER_CACHE];
 } vmmcache_t;
 
+// the range tree is protected by lock. page faults only take it as a reader and serialize
+// their page table changes with maplock, anything changing the ranges takes it as a writer.
+// generation is incremented on every write unlock so that a fault which dropped the lock
+// to do I/O can tell if the space changed in the meantime
 typedef struct {
-	mutex_t lock;
+	rwlock_t lock;
+	mutex_t maplock;
+	uintmax_t generation;
 	vmmrange_t *ranges;
+	vmmrange_t *root;
 	void *start;
 	void *end;
 } vmmspace_t;
@@ -65,6 +83,7 @@ typedef struct {
 typedef struct {
 	vmmspace_t space;
 	pagetableptr_t pagetable;
+	mmucpumask_t cpus; // cpus the context was loaded on since they were last shot down for it
 } vmmcontext_t;
 
 extern vmmcontext_t vmm_kernelctx;
@@ -8,6 +8,10 @@ extern size_t vmmcache_cachedpages;
 
 void vmmcache_init();
 int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res);
+int vmmcache_getpagetofill(vnode_t *vnode, uintmax_t offset, page_t **res, bool *fill);
+void vmmcache_endfill(page_t *page);
+page_t *vmmcache_trygetpage(vnode_t *vnode, uintmax_t offset);
+bool vmmcache_iscached(vnode_t *vnode, uintmax_t offset);
 int vmmcache_takepage(page_t *page);
 int vmmcache_makedirty(page_t *page);
 int vmmcache_truncate(vnode_t *vnode, uintmax_t offset);
@@ -15,5 +19,7 @@ int vmmcache_syncvnode(vnode_t *vnode, uintmax_t startoffset, size_t size);
 int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page);
 int vmmcache_sync();
 int vmmcache_evict(page_t *page);
+void vmmcache_pagein(vnode_t *vnode, uintmax_t offset, size_t size);
+void vmmcache_readahead(vnode_t *vnode, vfsreadahead_t *readahead, uintmax_t offset, size_t size, uintmax_t nodesize);
 
 #endif
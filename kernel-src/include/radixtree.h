@@ -0,0 +1,39 @@
+#ifndef _RADIXTREE_H
+#define _RADIXTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// sparse array indexed by an integer. every node has RADIXTREE_SLOTS slots, and the tree is only as tall as
+// needed for the biggest index in it.
+// inserting never allocates, as the callers might hold locks that the allocator could end up needing.
+// the nodes needed for an insert are preloaded beforehand instead.
+#define RADIXTREE_BITS 6
+#define RADIXTREE_SLOTS (1 << RADIXTREE_BITS)
+
+typedef struct radixnode_t {
+	struct radixnode_t *parent;
+	int offset; // slot in the parent
+	int count; // slots in use
+	void *slots[RADIXTREE_SLOTS];
+} radixnode_t;
+
+typedef struct {
+	radixnode_t *root;
+	int height;
+} radixtree_t;
+
+typedef struct {
+	radixnode_t *nodes; // linked through the parent pointer
+	size_t count;
+} radixpreload_t;
+
+void *radixtree_get(radixtree_t *tree, uintmax_t index);
+void *radixtree_next(radixtree_t *tree, uintmax_t *index);
+size_t radixtree_nodesneeded(radixtree_t *tree, uintmax_t index);
+void radixtree_insert(radixtree_t *tree, uintmax_t index, void *value, radixpreload_t *preload);
+void *radixtree_remove(radixtree_t *tree, uintmax_t index);
+int radixtree_preload(radixpreload_t *preload, size_t count);
+void radixtree_preloadfree(radixpreload_t *preload);
+
+#endif
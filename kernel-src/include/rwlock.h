@@ -0,0 +1,40 @@
+#ifndef _RWLOCK_H
+#define _RWLOCK_H
+
+#include <stdbool.h>
+#include <spinlock.h>
+#include <semaphore.h>
+
+// readers/writer lock. waiting writers block new readers so they don't starve,
+// and ownership is handed over directly to the woken threads on release
+typedef struct {
+	spinlock_t lock;
+	int readers;
+	bool writer;
+	int readerswaiting;
+	int writerswaiting;
+	semaphore_t readsem;
+	semaphore_t writesem;
+} rwlock_t;
+
+#define RWLOCK_INIT(x) { \
+		SPINLOCK_INIT((x)->lock); \
+		(x)->readers = 0; \
+		(x)->writer = false; \
+		(x)->readerswaiting = 0; \
+		(x)->writerswaiting = 0; \
+		SEMAPHORE_INIT(&(x)->readsem, 0); \
+		SEMAPHORE_INIT(&(x)->writesem, 0); \
+	}
+
+#define RWLOCK_ACQUIREREAD(x) rwlock_acquireread(x)
+#define RWLOCK_RELEASEREAD(x) rwlock_releaseread(x)
+#define RWLOCK_ACQUIREWRITE(x) rwlock_acquirewrite(x)
+#define RWLOCK_RELEASEWRITE(x) rwlock_releasewrite(x)
+
+void rwlock_acquireread(rwlock_t *rwlock);
+void rwlock_releaseread(rwlock_t *rwlock);
+void rwlock_acquirewrite(rwlock_t *rwlock);
+void rwlock_releasewrite(rwlock_t *rwlock);
+
+#endif
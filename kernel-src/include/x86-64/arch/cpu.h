@@ -10,7 +10,9 @@
 #include <kernel/vmm.h>
 #include <kernel/timer.h>
 #include <kernel/scheduler.h>
+#include <kernel/runqueue.h>
 #include <kernel/dpc.h>
+#include <kernel/pmm.h>
 #include <arch/apic.h>
 
 #define ARCH_EOI arch_apic_eoi
@@ -20,6 +22,7 @@ typedef struct cpu_t {
 	struct cpu_t *self;
 	vmmcontext_t *vmmctx;
 	long id;
+	int number; // 0 for the bsp, counted up for the aps in wakeup order
 	uint64_t gdt[7];
 	ist_t ist;
 	isr_t isr[MAX_ISR_COUNT];
@@ -29,6 +32,7 @@ typedef struct cpu_t {
 	long ipl;
 	thread_t *idlethread;
 	timerentry_t schedtimerentry;
+	time_t schedtickus; // period of the scheduler tick, 0 if it is disarmed
 	void *schedulerstack;
 
 	isr_t *isrqueue;
@@ -38,6 +42,18 @@ typedef struct cpu_t {
 
 	dpc_t  reschedule_dpc;
 	isr_t *reschedule_isr;
+
+	schedrunqueue_t runqueue;
+
+	pmmcpucache_t pmmcache;
+
+	mmupcidslot_t pcidslots[ARCH_MMU_PCID_COUNT];
+	uintmax_t pcidgeneration;
+	int pcidnext;
+
+	spinlock_t shootdownlock;
+	struct mmushootdown_t *shootdownqueue[ARCH_MMU_SHOOTDOWN_QUEUE_SIZE];
+	int shootdowncount;
 } cpu_t;
 
 #define CPU_HALT() asm volatile("hlt")
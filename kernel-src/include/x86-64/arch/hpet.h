@@ -2,9 +2,11 @@
 #define _HPET_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 time_t arch_hpet_ticks();
+uint64_t arch_hpet_frequency();
 void arch_hpet_waitticks(time_t ticks);
 void arch_hpet_waitus(time_t us);
 bool arch_hpet_exists();
@@ -13,6 +13,7 @@
 #define IS_USER_ADDRESS(a) ((void *)a < USERSPACE_END)
 
 #define PAGE_SIZE 4096
+#define ARCH_MMU_LARGEPAGE_SIZE 0x200000
 #define ARCH_MMU_FLAGS_READ (uint64_t)1
 #define ARCH_MMU_FLAGS_WRITE (uint64_t)2
 #define ARCH_MMU_FLAGS_USER (uint64_t)4
@@ -25,11 +26,44 @@
 typedef uint64_t mmuflags_t;
 typedef uint64_t * pagetableptr_t; // physical address
 
+// number of address spaces each cpu keeps tagged in the tlb with their own PCID
+#define ARCH_MMU_PCID_COUNT 32
+
+typedef struct {
+	pagetableptr_t table;
+	uintmax_t generation;
+} mmupcidslot_t;
+
+// cpus which might have entries of an address space in their tlb, indexed by cpu number
+#define ARCH_MMU_MAX_CPUS 256
+
+typedef struct {
+	uint64_t bits[ARCH_MMU_MAX_CPUS / 64];
+} mmucpumask_t;
+
+// invalidations collected to be done in a single shootdown round.
+// all of them have to be either in userspace or in the kernel
+#define ARCH_MMU_BATCH_SIZE 16
+
+typedef struct {
+	struct {
+		void *page;
+		size_t size;
+	} ranges[ARCH_MMU_BATCH_SIZE];
+	int count;
+	size_t pages;
+	bool kernel;
+	bool all;
+} mmutlbbatch_t;
+
+// shootdowns waiting to be done by a cpu
+#define ARCH_MMU_SHOOTDOWN_QUEUE_SIZE 16
+
 void arch_mmu_destroytable(pagetableptr_t table);
 bool arch_mmu_map(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
 void arch_mmu_unmap(pagetableptr_t table, void *vaddr);
 void arch_mmu_remap(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
-void arch_mmu_switch(pagetableptr_t table);
+void arch_mmu_switch(pagetableptr_t table, mmucpumask_t *cpus);
 void *arch_mmu_getphysical(pagetableptr_t table, void *vaddr);
 bool arch_mmu_ispresent(pagetableptr_t table, void *vaddr);
 bool arch_mmu_iswritable(pagetableptr_t table, void *vaddr);
@@ -38,6 +72,13 @@ pagetableptr_t arch_mmu_newtable();
 void arch_mmu_init();
 void arch_mmu_apswitch();
 void arch_mmu_invalidate_range(void *page, size_t size);
+void arch_mmu_batchadd(mmutlbbatch_t *batch, void *page, size_t size);
+void arch_mmu_invalidate_batch(mmutlbbatch_t *batch);
 bool arch_mmu_getflags(pagetableptr_t table, void *vaddr, mmuflags_t *mmuflagsp);
+bool arch_mmu_copyrange(pagetableptr_t dest, pagetableptr_t src, void *start, size_t size, bool hold);
+bool arch_mmu_maplarge(pagetableptr_t table, void *paddr, void *vaddr, mmuflags_t flags);
+bool arch_mmu_canmaplarge(pagetableptr_t table, void *vaddr);
+bool arch_mmu_islarge(pagetableptr_t table, void *vaddr);
+bool arch_mmu_splitlarge(pagetableptr_t table, void *vaddr);
 
 #endif
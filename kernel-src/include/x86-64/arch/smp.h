@@ -11,6 +11,7 @@
 extern size_t arch_smp_cpusawake;
 extern cpu_t **smp_cpus;
 
+size_t arch_smp_cpucount();
 void arch_smp_wakeup();
 void arch_smp_sendipi(cpu_t *targcpu, isr_t *isr, int target, bool nmi);
 void arch_smp_haltallothers();
@@ -0,0 +1,12 @@
+#ifndef _TSC_H
+#define _TSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+time_t arch_tsc_ticks();
+uint64_t arch_tsc_frequency();
+bool arch_tsc_init();
+
+#endif
@@ -0,0 +1,79 @@
+#include <kernel/kstat.h>
+#include <kernel/devfs.h>
+#include <kernel/alloc.h>
+#include <logging.h>
+#include <errno.h>
+#include <stdarg.h>
+
+// the providers get registered at boot and are never removed
+static kstatprovider_t providers[KSTAT_MAX_PROVIDERS];
+static size_t providercount;
+
+void kstat_register(kstatprovider_t provider) {
+	size_t index = __atomic_fetch_add(&providercount, 1, __ATOMIC_SEQ_CST);
+	__assert(index < KSTAT_MAX_PROVIDERS);
+	providers[index] = provider;
+}
+
+void kstat_printf(kstatbuffer_t *buffer, const char *format, ...) {
+	size_t left = buffer->offset < buffer->size ? buffer->size - buffer->offset : 0;
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(left ? buffer->buffer + buffer->offset : NULL, left, format, args);
+	va_end(args);
+
+	if (length > 0)
+		buffer->offset += length;
+}
+
+static void generate(kstatbuffer_t *buffer) {
+	size_t count = __atomic_load_n(&providercount, __ATOMIC_SEQ_CST);
+	for (size_t i = 0; i < count; ++i)
+		providers[i](buffer);
+}
+
+// the statistics are printed again on every read, and the part at offset is returned.
+// the first pass only measures the length, some slack is left for counters growing in between
+static int kstat_read(int minor, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, int flags, size_t *rcount) {
+	kstatbuffer_t buffer = {0};
+	generate(&buffer);
+
+	buffer.size = buffer.offset + 256;
+	buffer.offset = 0;
+	buffer.buffer = alloc(buffer.size);
+	if (buffer.buffer == NULL)
+		return ENOMEM;
+
+	generate(&buffer);
+
+	// the last byte is the null terminator from vsnprintf
+	size_t length = buffer.offset < buffer.size ? buffer.offset : buffer.size - 1;
+	*rcount = 0;
+	int error = 0;
+	if (offset < length) {
+		*rcount = length - offset < count ? length - offset : count;
+		error = iovec_iterator_copy_from_buffer(iovec_iterator, buffer.buffer + offset, *rcount);
+	}
+
+	free(buffer.buffer);
+	return error;
+}
+
+static int kstat_write(int minor, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, int flags, size_t *wcount) {
+	return EPERM;
+}
+
+static int kstat_maxseek(int minor, size_t *max) {
+	*max = 0;
+	return 0;
+}
+
+static devops_t kstatops = {
+	.read = kstat_read,
+	.write = kstat_write,
+	.maxseek = kstat_maxseek
+};
+
+void kstat_init() {
+	__assert(devfs_register(&kstatops, "kstat", V_TYPE_CHDEV, DEV_MAJOR_KSTAT, 0, 0444, NULL) == 0);
+}
@@ -0,0 +1,214 @@
+#include <radixtree.h>
+#include <kernel/alloc.h>
+#include <logging.h>
+#include <errno.h>
+
+#define INDEX_BITS (sizeof(uintmax_t) * 8)
+
+static inline int levelshift(int level) {
+	return (level - 1) * RADIXTREE_BITS;
+}
+
+static inline int slotof(uintmax_t index, int level) {
+	return (index >> levelshift(level)) & (RADIXTREE_SLOTS - 1);
+}
+
+static inline uintmax_t maxindex(int height) {
+	if (height * RADIXTREE_BITS >= INDEX_BITS)
+		return UINTMAX_MAX;
+
+	return ((uintmax_t)1 << (height * RADIXTREE_BITS)) - 1;
+}
+
+// smallest height with index in the tree
+static int heightfor(uintmax_t index) {
+	int height = 1;
+	while (index > maxindex(height))
+		++height;
+
+	return height;
+}
+
+static radixnode_t *takenode(radixpreload_t *preload) {
+	radixnode_t *node = preload->nodes;
+	__assert(node);
+	preload->nodes = node->parent;
+	--preload->count;
+	node->parent = NULL;
+	return node;
+}
+
+void *radixtree_get(radixtree_t *tree, uintmax_t index) {
+	if (tree->root == NULL || index > maxindex(tree->height))
+		return NULL;
+
+	radixnode_t *node = tree->root;
+	for (int level = tree->height; level > 1; --level) {
+		node = node->slots[slotof(index, level)];
+		if (node == NULL)
+			return NULL;
+	}
+
+	return node->slots[slotof(index, 1)];
+}
+
+static void *nextin(radixnode_t *node, int level, uintmax_t *index) {
+	int shift = levelshift(level);
+	for (;;) {
+		int slot = slotof(*index, level);
+		void *entry = node->slots[slot];
+		if (entry && level == 1)
+			return entry;
+
+		if (entry) {
+			// the index is left at the start of the next slot if nothing was found in it
+			entry = nextin(entry, level - 1, index);
+			if (entry)
+				return entry;
+		} else {
+			*index = ((*index >> shift) + 1) << shift;
+		}
+
+		// went past the last slot of this node
+		if (slotof(*index, level) <= slot)
+			return NULL;
+	}
+}
+
+// returns the first entry at or after *index, and sets *index to its index
+void *radixtree_next(radixtree_t *tree, uintmax_t *index) {
+	if (tree->root == NULL || *index > maxindex(tree->height))
+		return NULL;
+
+	return nextin(tree->root, tree->height, index);
+}
+
+// upper bound of the nodes an insert at index will take from the preload
+size_t radixtree_nodesneeded(radixtree_t *tree, uintmax_t index) {
+	int height = heightfor(index);
+	if (tree->root == NULL)
+		return height;
+
+	// the tree has to grow. index is outside of the old root, so its path below the new root is missing too
+	if (height > tree->height)
+		return (height - tree->height) + (height - 1);
+
+	radixnode_t *node = tree->root;
+	for (int level = tree->height; level > 1; --level) {
+		node = node->slots[slotof(index, level)];
+		if (node == NULL)
+			return level - 1;
+	}
+
+	return 0;
+}
+
+void radixtree_insert(radixtree_t *tree, uintmax_t index, void *value, radixpreload_t *preload) {
+	__assert(value);
+	int height = heightfor(index);
+
+	if (tree->root == NULL) {
+		tree->root = takenode(preload);
+		tree->height = height;
+	}
+
+	while (tree->height < height) {
+		radixnode_t *newroot = takenode(preload);
+		newroot->slots[0] = tree->root;
+		newroot->count = 1;
+		tree->root->parent = newroot;
+		tree->root->offset = 0;
+		tree->root = newroot;
+		++tree->height;
+	}
+
+	radixnode_t *node = tree->root;
+	for (int level = tree->height; level > 1; --level) {
+		int slot = slotof(index, level);
+		if (node->slots[slot] == NULL) {
+			radixnode_t *child = takenode(preload);
+			child->parent = node;
+			child->offset = slot;
+			node->slots[slot] = child;
+			++node->count;
+		}
+
+		node = node->slots[slot];
+	}
+
+	int slot = slotof(index, 1);
+	__assert(node->slots[slot] == NULL);
+	node->slots[slot] = value;
+	++node->count;
+}
+
+// empty nodes are freed and the tree shrinks back down when only its first slot is used
+void *radixtree_remove(radixtree_t *tree, uintmax_t index) {
+	if (tree->root == NULL || index > maxindex(tree->height))
+		return NULL;
+
+	radixnode_t *node = tree->root;
+	for (int level = tree->height; level > 1; --level) {
+		node = node->slots[slotof(index, level)];
+		if (node == NULL)
+			return NULL;
+	}
+
+	int slot = slotof(index, 1);
+	void *value = node->slots[slot];
+	if (value == NULL)
+		return NULL;
+
+	node->slots[slot] = NULL;
+	--node->count;
+
+	while (node->count == 0) {
+		radixnode_t *parent = node->parent;
+		if (parent == NULL) {
+			tree->root = NULL;
+			tree->height = 0;
+			free(node);
+			return value;
+		}
+
+		parent->slots[node->offset] = NULL;
+		--parent->count;
+		free(node);
+		node = parent;
+	}
+
+	while (tree->height > 1 && tree->root->count == 1 && tree->root->slots[0]) {
+		radixnode_t *oldroot = tree->root;
+		tree->root = oldroot->slots[0];
+		tree->root->parent = NULL;
+		--tree->height;
+		free(oldroot);
+	}
+
+	return value;
+}
+
+// allocates nodes until there are at least count of them in the preload
+int radixtree_preload(radixpreload_t *preload, size_t count) {
+	while (preload->count < count) {
+		radixnode_t *node = alloc(sizeof(radixnode_t));
+		if (node == NULL)
+			return ENOMEM;
+
+		node->parent = preload->nodes;
+		preload->nodes = node;
+		++preload->count;
+	}
+
+	return 0;
+}
+
+void radixtree_preloadfree(radixpreload_t *preload) {
+	while (preload->nodes) {
+		radixnode_t *node = preload->nodes;
+		preload->nodes = node->parent;
+		free(node);
+	}
+
+	preload->count = 0;
+}
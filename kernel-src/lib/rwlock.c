@@ -0,0 +1,67 @@
+#include <rwlock.h>
+#include <logging.h>
+
+void rwlock_acquireread(rwlock_t *rwlock) {
+	bool intstate = spinlock_acquireirqclear(&rwlock->lock);
+
+	if (rwlock->writer == false && rwlock->writerswaiting == 0) {
+		++rwlock->readers;
+		spinlock_releaseirqrestore(&rwlock->lock, intstate);
+		return;
+	}
+
+	// the releasing writer will count us as a reader before waking us up
+	++rwlock->readerswaiting;
+	spinlock_releaseirqrestore(&rwlock->lock, intstate);
+	semaphore_wait(&rwlock->readsem, false);
+}
+
+void rwlock_releaseread(rwlock_t *rwlock) {
+	bool intstate = spinlock_acquireirqclear(&rwlock->lock);
+	__assert(rwlock->readers > 0 && rwlock->writer == false);
+
+	if (--rwlock->readers == 0 && rwlock->writerswaiting) {
+		// hand the lock over to a writer
+		--rwlock->writerswaiting;
+		rwlock->writer = true;
+		semaphore_signal(&rwlock->writesem);
+	}
+
+	spinlock_releaseirqrestore(&rwlock->lock, intstate);
+}
+
+void rwlock_acquirewrite(rwlock_t *rwlock) {
+	bool intstate = spinlock_acquireirqclear(&rwlock->lock);
+
+	if (rwlock->writer == false && rwlock->readers == 0) {
+		rwlock->writer = true;
+		spinlock_releaseirqrestore(&rwlock->lock, intstate);
+		return;
+	}
+
+	++rwlock->writerswaiting;
+	spinlock_releaseirqrestore(&rwlock->lock, intstate);
+	semaphore_wait(&rwlock->writesem, false);
+}
+
+void rwlock_releasewrite(rwlock_t *rwlock) {
+	bool intstate = spinlock_acquireirqclear(&rwlock->lock);
+	__assert(rwlock->writer && rwlock->readers == 0);
+
+	if (rwlock->readerswaiting) {
+		// readers that queued up behind us get the lock first, so they can't be starved by writers
+		rwlock->writer = false;
+		rwlock->readers = rwlock->readerswaiting;
+		rwlock->readerswaiting = 0;
+		for (int i = 0; i < rwlock->readers; ++i)
+			semaphore_signal(&rwlock->readsem);
+	} else if (rwlock->writerswaiting) {
+		// the lock stays write locked and goes to the next writer
+		--rwlock->writerswaiting;
+		semaphore_signal(&rwlock->writesem);
+	} else {
+		rwlock->writer = false;
+	}
+
+	spinlock_releaseirqrestore(&rwlock->lock, intstate);
+}
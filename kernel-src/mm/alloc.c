@@ -1,106 +1,158 @@
 #include <kernel/alloc.h>
 #include <kernel/slab.h>
+#include <kernel/vmm.h>
+#include <kernel/pmm.h>
+#include <arch/cpu.h>
 #include <logging.h>
 #include <string.h>
+#include <util.h>
+#include <kernel/kstat.h>
 
-// each allocation has the following structure:
-// ptr: data capacity (allocsizes size)
-// ptr + sizeof(size_t): current size
-// ptr + sizeof(size_t) * 2: data
-// ptr + datasize: poison value
+// allocations are served from slab caches with the following size classes:
+// 16 to 256 bytes in 16 byte steps, then 4 classes per power of two (320, 384, 448, 512, 640...) up to ALLOC_MAX_CLASS.
+// objects don't have a header, the size class is found through the slab the object belongs to.
+// the memory past the requested size is always kept zeroed, so realloc doesn't need to know the old size.
+// anything bigger than ALLOC_MAX_CLASS is mapped directly with vmm_map, and the size of the mapping
+// is kept in the page_t of its first page.
 
-#define USE_POISON 0
-#define POISON_VALUE 0xdeadbeefbadc0ffel
-#define CACHE_COUNT 12
+#define SMALL_STEP 16
+#define SMALL_MAX 256
+#define SMALL_COUNT (SMALL_MAX / SMALL_STEP)
+#define QUARTER_BASEORDER 8
+#define ALLOC_MAX_CLASS 32768
+#define CLASS_COUNT (SMALL_COUNT + (15 - QUARTER_BASEORDER) * 4)
 
-#define CAPACITY_SIZE(cache) cache->size - sizeof(size_t) * 2 - USE_POISON * sizeof(size_t)
+static scache_t *caches[CLASS_COUNT];
 
-static size_t allocsizes[CACHE_COUNT] = {32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536};
-static scache_t *caches[CACHE_COUNT];
+static uintmax_t largecount;
+static uintmax_t largebytes;
 
 static void initarea(scache_t *cache, void *obj) {
-	size_t *ptr = obj;
-	*ptr = CAPACITY_SIZE(cache);
-	memset(ptr + 2, 0, *ptr);
-	#if USE_POISON == 1
-	*((size_t *)((uintptr_t)obj + cache->size - sizeof(size_t))) = POISON_VALUE;
-	#endif
+	memset(obj, 0, cache->size);
 }
 
-static void dtor(scache_t *cache, void *obj) {
-#if USE_POISON == 1
-	__assert(*(size_t *)((uintptr_t)obj + cache->size - sizeof(size_t)) == POISON_VALUE);
-#endif
-	initarea(cache, obj);
+static size_t getclasssize(int index) {
+	if (index < SMALL_COUNT)
+		return (index + 1) * SMALL_STEP;
+
+	int order = QUARTER_BASEORDER + (index - SMALL_COUNT) / 4;
+	int quarter = (index - SMALL_COUNT) % 4 + 1;
+	return ((size_t)1 << order) + quarter * ((size_t)1 << (order - 2));
 }
 
-static scache_t *getcachefromsize(size_t size) {
-	scache_t *cache = NULL;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (size <= allocsizes[i]) {
-			cache = caches[i];
-			break;
-		}
-	}
-	__assert(cache);
-	return cache;
+static int getclassindex(size_t size) {
+	if (size <= SMALL_MAX)
+		return size ? (size - 1) / SMALL_STEP : 0;
+
+	// 2^order < size <= 2^(order + 1)
+	int order = log2(size - 1);
+	size_t step = (size_t)1 << (order - 2);
+	int quarter = ROUND_UP(size - ((size_t)1 << order), step) / step;
+	return SMALL_COUNT + (order - QUARTER_BASEORDER) * 4 + quarter - 1;
 }
 
-void *alloc(size_t size) {
-	scache_t *cache = getcachefromsize(size);
-	size_t *ret = slab_allocate(cache);
-	if (ret == NULL)
+static page_t *getpage(void *ptr) {
+	void *physical = arch_mmu_getphysical(current_vmm_context()->pagetable, (void *)ROUND_DOWN((uintptr_t)ptr, PAGE_SIZE));
+	__assert(physical);
+	return pmm_getpage(physical);
+}
+
+static void *largealloc(size_t size) {
+	size = ROUND_UP(size, PAGE_SIZE);
+	void *ptr = vmm_map(NULL, size, VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
+	if (ptr == NULL)
 		return NULL;
-	__assert(*ret == CAPACITY_SIZE(cache));
-	*(ret + 1) = size;
-	return ret + 2;
+
+	page_t *page = getpage(ptr);
+	page->flags |= PAGE_FLAGS_LARGEALLOC;
+	page->allocsize = size;
+
+	__atomic_add_fetch(&largecount, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&largebytes, size, __ATOMIC_SEQ_CST);
+	return ptr;
+}
+
+// returns how many bytes can be used in an allocation
+static size_t getcapacity(void *ptr) {
+	page_t *page = getpage(ptr);
+	if (page->flags & PAGE_FLAGS_LARGEALLOC)
+		return page->allocsize;
+
+	__assert(page->slab);
+	return page->slab->cache->size;
+}
+
+void *alloc(size_t size) {
+	if (size > ALLOC_MAX_CLASS)
+		return largealloc(size);
+
+	return slab_allocate(caches[getclassindex(size)]);
 }
 
 void free(void *ptr) {
-	size_t *start = ptr;
-	start -= 2;
-	size_t size = *start;
-	scache_t *cache = getcachefromsize(size);
-	slab_free(cache, start);
+	if (ptr == NULL)
+		return;
+
+	page_t *page = getpage(ptr);
+	if (page->flags & PAGE_FLAGS_LARGEALLOC) {
+		__assert(((uintptr_t)ptr % PAGE_SIZE) == 0);
+		size_t size = page->allocsize;
+		__atomic_sub_fetch(&largecount, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&largebytes, size, __ATOMIC_SEQ_CST);
+		vmm_unmap(ptr, size, 0);
+		return;
+	}
+
+	__assert(page->slab);
+	slab_free(page->slab->cache, ptr);
 }
 
 void *realloc(void *ptr, size_t size) {
 	if (!ptr)
 		return alloc(size);
 
-	size_t *start = ptr;
-	start -= 2;
-	size_t currentsize = *(start + 1);
-	if (size <= currentsize) {
-		*(start + 1) = size;
+	size_t capacity = getcapacity(ptr);
+	if (size <= capacity) {
+		// keep the memory past the new size zeroed
+		memset((void *)((uintptr_t)ptr + size), 0, capacity - size);
 		return ptr;
 	}
 
-	// grow
-	scache_t *oldcache = getcachefromsize(*start);
-	scache_t *newcache = getcachefromsize(size);
+	void *new = alloc(size);
+	if (new == NULL)
+		return NULL;
 
-	// same allocation
-	if (oldcache == newcache) {
-		size_t diff = size - currentsize;
-		memset((void *)((uintptr_t)ptr + currentsize), 0, diff);
-		*(start + 1) = size;
-		return ptr;
+	memcpy(new, ptr, capacity);
+	free(ptr);
+	return new;
+}
+
+// one line per size class in use, with the magazine statistics of its slab cache
+static void allockstat(kstatbuffer_t *buffer) {
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		slabstats_t stats;
+		slab_getstats(caches[i], &stats);
+		if (stats.slabs == 0)
+			continue;
+
+		size_t live = stats.usedobjects - stats.cachedobjects;
+		// memory in the slabs of this class not holding live objects
+		size_t wasted = (stats.objects - live) * caches[i]->truesize;
+		kstat_printf(buffer, "alloc.class%lu: slabs %lu objects %lu live %lu cached %lu wasted %lu", caches[i]->size, stats.slabs, stats.objects, live, stats.cachedobjects, wasted);
+		kstat_printf(buffer, " allochits %lu allocmisses %lu freehits %lu freemisses %lu exchanges %lu flushes %lu\n",
+			stats.allochits, stats.allocmisses, stats.freehits, stats.freemisses, stats.depotexchanges, stats.depotflushes);
 	}
 
-	// different allocation
-	size_t *new = slab_allocate(newcache);
-	if (new == NULL)
-		return NULL;
-	*(new + 1) = size;
-	memcpy((new + 2), ptr, currentsize);
-	slab_free(oldcache, start);
-	return new + 2;
+	kstat_printf(buffer, "alloc.large.count: %lu\n", largecount);
+	kstat_printf(buffer, "alloc.large.bytes: %lu\n", largebytes);
 }
 
 void alloc_init() {
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		caches[i] = slab_newcache(allocsizes[i] + sizeof(size_t) * 2 + sizeof(size_t) * USE_POISON, 0, initarea, dtor);
+	for (int i = 0; i < CLASS_COUNT; ++i) {
+		caches[i] = slab_newcache(getclasssize(i), 0, initarea, initarea);
 		__assert(caches[i]);
 	}
+
+	__assert(getclasssize(CLASS_COUNT - 1) == ALLOC_MAX_CLASS);
+	kstat_register(allockstat);
 }
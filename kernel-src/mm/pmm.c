@@ -6,31 +6,38 @@
 #include <mutex.h>
 #include <util.h>
 #include <kernel/vmmcache.h>
+#include <arch/cpu.h>
+#include <kernel/scheduler.h>
+#include <kernel/kstat.h>
+#include <kernel/slab.h>
+#include <arch/smp.h>
 
 uintptr_t hhdmbase;
 static size_t memorysize;
 static size_t pagecount;
 size_t freepagecount;
+static size_t standbypagecount;
 
 static mutex_t freelistmutex;
-static page_t *freelists[PMM_SECTION_COUNT];
-static page_t *freetails[PMM_SECTION_COUNT];
 static page_t *standbylists[PMM_SECTION_COUNT];
 static page_t *standbytails[PMM_SECTION_COUNT];
 
+// free anonymous memory is kept in a buddy allocator per section.
+// a free block of 2^order pages is represented by its first page, which is the only one
+// with PAGE_FLAGS_FREE set and is placed in the free list of its order.
 typedef struct {
 	uintmax_t baseid;
 	uintmax_t topid;
-	uintmax_t searchstart;
+	page_t *freelists[PMM_MAX_ORDER + 1];
 } section_t;
 
 #define TOP_1MB (0x100000 / PAGE_SIZE)
 #define TOP_4GB ((uint64_t)0x100000000 / PAGE_SIZE)
 
 static section_t sections[PMM_SECTION_COUNT] = {
-	{0, TOP_1MB, 0},
-	{TOP_1MB, TOP_4GB, TOP_1MB},
-	{TOP_4GB, 0xffffffffffffffffl, TOP_4GB}
+	{0, TOP_1MB},
+	{TOP_1MB, TOP_4GB},
+	{TOP_4GB, 0xffffffffffffffffl}
 };
 
 static volatile struct limine_hhdm_request hhdmreq = {
@@ -49,55 +56,72 @@ static page_t* pages;
 #define PAGE_BOUNDARYCHECK(pageid) \
 	__assert((pageid) * PAGE_SIZE < (uintptr_t)pages || (pageid) * PAGE_SIZE >= (uintptr_t)&pages[pagecount])
 
-static void insertinfreelist(page_t *page) {
-	uintmax_t pageid = PAGE_GETID(page);
-	PAGE_BOUNDARYCHECK(pageid);
-	struct page_t **list;
-	struct page_t **tail;
-
-	int section;
-
+static inline int getsection(uintmax_t pageid) {
 	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
+		return PMM_SECTION_1MB;
 	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
+		return PMM_SECTION_4GB;
 	else
-		section = PMM_SECTION_DEFAULT;
-
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
+		return PMM_SECTION_DEFAULT;
+}
 
-	if (sections[section].searchstart > pageid)
-		sections[section].searchstart = pageid;
+static void insertinstandbylist(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+	int section = getsection(pageid);
 
-	page->freenext = *list;
+	page->freenext = standbylists[section];
 	page->freeprev = NULL;
-	*list = page;
+	standbylists[section] = page;
 	if (page->freenext)
 		page->freenext->freeprev = page;
 	else
-		*tail = page;
+		standbytails[section] = page;
 
 	++freepagecount;
+	++standbypagecount;
 }
 
-static void removefromfreelist(page_t *page) {
+static void removefromstandbylist(page_t *page) {
 	uintmax_t pageid = PAGE_GETID(page);
 	PAGE_BOUNDARYCHECK(pageid);
-	struct page_t **list;
-	struct page_t **tail;
+	int section = getsection(pageid);
 
-	int section;
+	if (page->freeprev)
+		page->freeprev->freenext = page->freenext;
+	else
+		standbylists[section] = page->freenext;
 
-	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
-	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
+	if (page->freenext)
+		page->freenext->freeprev = page->freeprev;
 	else
-		section = PMM_SECTION_DEFAULT;
+		standbytails[section] = page->freeprev;
+
+	--freepagecount;
+	--standbypagecount;
+}
+
+static void buddyinsert(page_t *page, int order) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+	page_t **list = &sections[getsection(pageid)].freelists[order];
+
+	page->flags = PAGE_FLAGS_FREE;
+	page->order = order;
+	page->freenext = *list;
+	page->freeprev = NULL;
+	if (page->freenext)
+		page->freenext->freeprev = page;
+	*list = page;
+
+	freepagecount += (size_t)1 << order;
+}
 
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
+static void buddyremove(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+	__assert(page->flags & PAGE_FLAGS_FREE);
+	page_t **list = &sections[getsection(pageid)].freelists[page->order];
 
 	if (page->freeprev)
 		page->freeprev->freenext = page->freenext;
@@ -106,18 +130,107 @@ static void removefromfreelist(page_t *page) {
 
 	if (page->freenext)
 		page->freenext->freeprev = page->freeprev;
-	else
-		*tail = page->freeprev;
 
-	--freepagecount;
+	page->flags &= ~PAGE_FLAGS_FREE;
+	freepagecount -= (size_t)1 << page->order;
+}
+
+// frees a block of 2^order pages, coalescing it with its buddies while they are free
+static void buddyfree(uintmax_t pageid, int order) {
+	int section = getsection(pageid);
+
+	while (order < PMM_MAX_ORDER) {
+		uintmax_t buddyid = pageid ^ ((uintmax_t)1 << order);
+		if (buddyid >= pagecount || getsection(buddyid) != section)
+			break;
+
+		page_t *buddy = &pages[buddyid];
+		if ((buddy->flags & PAGE_FLAGS_FREE) == 0 || buddy->order != order)
+			break;
+
+		buddyremove(buddy);
+		pageid = min(pageid, buddyid);
+		++order;
+	}
+
+	buddyinsert(&pages[pageid], order);
+}
+
+// takes a block of 2^order pages from a section, splitting a bigger block if needed
+static page_t *buddyalloc(int section, int order) {
+	int blockorder = order;
+	while (blockorder <= PMM_MAX_ORDER && sections[section].freelists[blockorder] == NULL)
+		++blockorder;
+
+	if (blockorder > PMM_MAX_ORDER)
+		return NULL;
+
+	page_t *page = sections[section].freelists[blockorder];
+	buddyremove(page);
+
+	// give back the upper halves
+	while (blockorder > order) {
+		--blockorder;
+		buddyinsert(page + ((size_t)1 << blockorder), blockorder);
+	}
+
+	return page;
+}
+
+// allocations bigger than the biggest block are made from runs of consecutive free blocks of the biggest order
+static page_t *buddyallocrun(int section, size_t blockcount) {
+	size_t blocksize = (size_t)1 << PMM_MAX_ORDER;
+
+	for (page_t *page = sections[section].freelists[PMM_MAX_ORDER]; page; page = page->freenext) {
+		uintmax_t pageid = PAGE_GETID(page);
+		size_t found = 1;
+
+		while (found < blockcount) {
+			uintmax_t nextid = pageid + found * blocksize;
+			if (nextid >= pagecount || getsection(nextid) != section)
+				break;
+
+			page_t *next = &pages[nextid];
+			if ((next->flags & PAGE_FLAGS_FREE) == 0 || next->order != PMM_MAX_ORDER)
+				break;
+
+			++found;
+		}
+
+		if (found == blockcount) {
+			for (size_t i = 0; i < blockcount; ++i)
+				buddyremove(&pages[pageid + i * blocksize]);
+
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+// frees a range of pages in the biggest naturally aligned blocks possible
+static void freerange(uintmax_t pageid, size_t count) {
+	while (count) {
+		int order = 0;
+		while (order < PMM_MAX_ORDER) {
+			size_t nextsize = (size_t)1 << (order + 1);
+			if ((pageid & (nextsize - 1)) || nextsize > count || getsection(pageid) != getsection(pageid + nextsize - 1))
+				break;
+			++order;
+		}
+
+		buddyfree(pageid, order);
+		pageid += (size_t)1 << order;
+		count -= (size_t)1 << order;
+	}
 }
 
 static void internalhold(page_t *page) {
 	__atomic_add_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 	if (page->refcount == 1) {
 		// this is only valid on standby pages, in case of free pages its an use after free
-		__assert((page->flags & PAGE_FLAGS_FREE) == 0);
-		removefromfreelist(page);
+		__assert((page->flags & (PAGE_FLAGS_FREE | PAGE_FLAGS_CPUCACHED)) == 0);
+		removefromstandbylist(page);
 	}
 }
 
@@ -137,6 +250,179 @@ void pmm_hold(void *addr) {
 	MUTEX_RELEASE(&freelistmutex);
 }
 
+// holds a batch of pages taking the lock only once
+void pmm_holdmany(void **addrs, size_t count) {
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	for (size_t i = 0; i < count; ++i)
+		internalhold(&pages[((uintptr_t)addrs[i] / PAGE_SIZE)]);
+	MUTEX_RELEASE(&freelistmutex);
+}
+
+// allocated pages zeroed ahead of time by a low priority thread, linked through freenext.
+// pmm_allocpagezeroed takes from here first, saving the memset when a page is needed
+#define ZEROPOOL_TARGET 512
+#define ZEROPOOL_RESERVE 4096
+// lower than user threads, so it only runs when the cpu would be otherwise idle
+#define ZEROPOOL_PRIORITY 2
+
+static page_t *zeropool;
+static size_t zeropoolcount;
+static spinlock_t zeropoollock;
+static semaphore_t zeropoolsem;
+static uintmax_t zeropoolhits;
+static uintmax_t zeropoolmisses;
+
+static page_t *zeropooltake() {
+	long oldipl = spinlock_acquireraiseipl(&zeropoollock, IPL_DPC);
+	page_t *page = zeropool;
+	if (page) {
+		zeropool = page->freenext;
+		page->freenext = NULL;
+		--zeropoolcount;
+		++zeropoolhits;
+	} else {
+		++zeropoolmisses;
+	}
+
+	bool refill = zeropoolcount < ZEROPOOL_TARGET / 2;
+	spinlock_releaseloweripl(&zeropoollock, oldipl);
+
+	if (refill)
+		semaphore_signal_limit(&zeropoolsem, 1);
+
+	return page;
+}
+
+// the per cpu caches are only accessed by their own cpu with the ipl raised to IPL_DPC
+// so the thread can't be preempted or migrated while using them.
+
+static page_t *cachetake() {
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	pmmcpucache_t *cache = &current_cpu()->pmmcache;
+	page_t *page = NULL;
+
+	if (cache->count) {
+		page = cache->pages[--cache->count];
+		__assert(page->flags & PAGE_FLAGS_CPUCACHED);
+		++cache->hits;
+	} else {
+		++cache->misses;
+	}
+
+	interrupt_loweripl(oldipl);
+	return page;
+}
+
+// puts as many pages of the batch in the current cpu cache as possible and returns how many were put
+static size_t cacheputbatch(page_t **batch, size_t count) {
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	pmmcpucache_t *cache = &current_cpu()->pmmcache;
+	size_t put = 0;
+
+	while (put < count && cache->count < PMM_CPUCACHE_SIZE)
+		cache->pages[cache->count++] = batch[put++];
+
+	interrupt_loweripl(oldipl);
+	return put;
+}
+
+// expects freelistmutex to be held
+static size_t takebatch(page_t **batch) {
+	size_t count = 0;
+
+	for (int i = PMM_SECTION_DEFAULT; i >= 0 && count < PMM_CPUCACHE_BATCH; --i) {
+		page_t *page;
+		while (count < PMM_CPUCACHE_BATCH && (page = buddyalloc(i, 0))) {
+			__assert(page->refcount == 0);
+			page->flags = PAGE_FLAGS_CPUCACHED;
+			batch[count++] = page;
+		}
+	}
+
+	return count;
+}
+
+// expects freelistmutex to be held
+static void returnbatch(page_t **batch, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		buddyfree(PAGE_GETID(batch[i]), 0);
+}
+
+static void releasetocache(page_t *page) {
+	page->flags = PAGE_FLAGS_CPUCACHED;
+
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	pmmcpucache_t *cache = &current_cpu()->pmmcache;
+	page_t *batch[PMM_CPUCACHE_BATCH];
+	size_t drained = 0;
+
+	if (cache->count == PMM_CPUCACHE_SIZE) {
+		// cache is full, drain the oldest pages back to the free lists
+		drained = PMM_CPUCACHE_BATCH;
+		memcpy(batch, cache->pages, sizeof(page_t *) * drained);
+		cache->count -= drained;
+		for (size_t i = 0; i < cache->count; ++i)
+			cache->pages[i] = cache->pages[i + drained];
+
+		++cache->drains;
+	}
+
+	cache->pages[cache->count++] = page;
+	interrupt_loweripl(oldipl);
+
+	if (drained) {
+		MUTEX_ACQUIRE(&freelistmutex, false);
+		returnbatch(batch, drained);
+		MUTEX_RELEASE(&freelistmutex);
+	}
+}
+
+// gives all the pages in the current cpu cache back to the free lists
+static void draincache() {
+	page_t *batch[PMM_CPUCACHE_SIZE];
+
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	pmmcpucache_t *cache = &current_cpu()->pmmcache;
+	size_t count = cache->count;
+	memcpy(batch, cache->pages, sizeof(page_t *) * count);
+	cache->count = 0;
+	if (count)
+		++cache->drains;
+	interrupt_loweripl(oldipl);
+
+	if (count) {
+		MUTEX_ACQUIRE(&freelistmutex, false);
+		returnbatch(batch, count);
+		MUTEX_RELEASE(&freelistmutex);
+	}
+}
+
+// pages released on other cpus can sit in their caches while the free lists are empty.
+// only a cpu can touch its own cache, so the thread goes through each cpu to drain them
+static void drainallcaches() {
+	thread_t *thread = current_thread();
+	if (smp_cpus == NULL || thread == NULL) {
+		draincache();
+		return;
+	}
+
+	cpu_t *target = thread->cputarget;
+	for (size_t i = 0; i < arch_smp_cpucount(); ++i) {
+		cpu_t *cpu = smp_cpus[i];
+		// with nosmp, the cpus which were never woken up have no scheduler set up
+		if (cpu->reschedule_isr == NULL)
+			continue;
+
+		sched_reschedule_on_cpu(cpu, true);
+		draincache();
+	}
+
+	if (target)
+		sched_reschedule_on_cpu(target, true);
+	else
+		sched_target_cpu(NULL);
+}
+
 void pmm_release(void *addr) {
 	page_t *page = &pages[(uintptr_t)addr / PAGE_SIZE];
 	__assert(page->refcount != 0);
@@ -144,10 +430,13 @@ void pmm_release(void *addr) {
 	uintmax_t newrefcount = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 	if (newrefcount == 0) {
 		__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
+		if (page->backing == NULL) {
+			releasetocache(page);
+			return;
+		}
+
 		MUTEX_ACQUIRE(&freelistmutex, false);
-		insertinfreelist(page);
-		if (page->backing == NULL)
-			page->flags |= PAGE_FLAGS_FREE;
+		insertinstandbylist(page);
 		MUTEX_RELEASE(&freelistmutex);
 	}
 }
@@ -159,21 +448,52 @@ static void doalloc(page_t *page) {
 }
 
 void *pmm_allocpage(int section) {
+	page_t *page = NULL;
+	bool drained = false;
+
+	// the cpu caches can hold pages from any section, so they can only be used for default section allocations
+	if (section == PMM_SECTION_DEFAULT) {
+		page = cachetake();
+		if (page)
+			goto gotpage;
+
+		page_t *batch[PMM_CPUCACHE_BATCH];
+		MUTEX_ACQUIRE(&freelistmutex, false);
+		size_t count = takebatch(batch);
+		MUTEX_RELEASE(&freelistmutex);
+
+		if (count) {
+			// keep the first page and put the rest in the cache
+			page = batch[0];
+			size_t put = cacheputbatch(&batch[1], count - 1);
+			if (put != count - 1) {
+				// the thread got moved to another cpu whose cache was already filled up
+				MUTEX_ACQUIRE(&freelistmutex, false);
+				returnbatch(&batch[1 + put], count - 1 - put);
+				MUTEX_RELEASE(&freelistmutex);
+			}
+
+			long oldipl = interrupt_raiseipl(IPL_DPC);
+			++current_cpu()->pmmcache.refills;
+			interrupt_loweripl(oldipl);
+			goto gotpage;
+		}
+	}
+
 	retry:
 	MUTEX_ACQUIRE(&freelistmutex, false);
-	page_t *page = NULL;
 
 	// try to take a free anonymous page
 	for (int i = section; i >= 0; --i) {
-		page = freelists[i];
+		page = buddyalloc(i, 0);
 		if (page) {
-			removefromfreelist(page);
 			__assert(page->refcount == 0);
 			break;
 		}
 	}
 
 	bool cachepage = false;
+	bool lowmemory = page == NULL;
 
 	// if that wasn't possible, try to take from the cache standby list
 	if (page == NULL) {
@@ -189,6 +509,10 @@ void *pmm_allocpage(int section) {
 
 	MUTEX_RELEASE(&freelistmutex);
 
+	// have the slab magazines and empty slabs given back, before the page cache is evicted any further
+	if (lowmemory)
+		slab_lowmemory();
+
 	if (cachepage && vmmcache_takepage(page) == EAGAIN) {
 		// someone already got the page from the cache between us holding it and taking it
 		pmm_release(pmm_getpageaddress(page));
@@ -201,24 +525,103 @@ void *pmm_allocpage(int section) {
 		page->refcount = 0;
 	}
 
+	if (page == NULL && drained == false) {
+		// the pages could still be in the caches of other cpus, give them back and try once more
+		drained = true;
+		drainallcaches();
+		goto retry;
+	}
+
+	gotpage:
 	void *address = NULL;
 	if (page) {
 		address = (void *)(PAGE_GETID(page) * PAGE_SIZE);
 		doalloc(page);
+	} else if (section == PMM_SECTION_DEFAULT && (page = zeropooltake())) {
+		// out of memory, give out a page that was zeroed in advance
+		address = (void *)(PAGE_GETID(page) * PAGE_SIZE);
+	}
+
+	return address;
+}
+
+void *pmm_allocpagezeroed(int section) {
+	if (section == PMM_SECTION_DEFAULT) {
+		page_t *page = zeropooltake();
+		if (page)
+			return pmm_getpageaddress(page);
 	}
 
+	void *address = pmm_allocpage(section);
+	if (address)
+		memset(MAKE_HHDM(address), 0, PAGE_SIZE);
+
 	return address;
 }
 
+// the pool is topped back up whenever it drops below half of the target
+static void zerothread() {
+	for (;;) {
+		semaphore_wait(&zeropoolsem, false);
+
+		// only use memory that is actually free, and not evict the page cache for this
+		while (zeropoolcount < ZEROPOOL_TARGET && freepagecount - standbypagecount > ZEROPOOL_RESERVE) {
+			void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+			if (address == NULL)
+				break;
+
+			memset(MAKE_HHDM(address), 0, PAGE_SIZE);
+
+			long oldipl = spinlock_acquireraiseipl(&zeropoollock, IPL_DPC);
+			page_t *page = pmm_getpage(address);
+			page->freenext = zeropool;
+			zeropool = page;
+			++zeropoolcount;
+			spinlock_releaseloweripl(&zeropoollock, oldipl);
+
+			// anything else that became runnable has a higher priority, so let it run
+			sched_yield();
+		}
+	}
+}
+
+static void zeropoolkstat(kstatbuffer_t *buffer) {
+	kstat_printf(buffer, "pmm.zeropool.pages: %lu\n", zeropoolcount);
+	kstat_printf(buffer, "pmm.zeropool.hits: %lu\n", zeropoolhits);
+	kstat_printf(buffer, "pmm.zeropool.misses: %lu\n", zeropoolmisses);
+}
+
+void pmm_zeropoolinit() {
+	SEMAPHORE_INIT(&zeropoolsem, 0);
+	thread_t *thread = sched_newthread(zerothread, PAGE_SIZE * 4, ZEROPOOL_PRIORITY, NULL, NULL);
+	__assert(thread);
+	sched_queue(thread);
+	semaphore_signal(&zeropoolsem);
+	kstat_register(zeropoolkstat);
+}
+
 void pmm_makefree(void *address, size_t count) {
 	memorysize += PAGE_SIZE * count;
 	__assert(((uintptr_t)address % PAGE_SIZE) == 0);
 	uintmax_t baseid = (uintptr_t)address / PAGE_SIZE;
-	for (int i = 0; i < count; ++i) {
-		uintmax_t pageid = baseid + i;
-		PAGE_BOUNDARYCHECK(pageid);
-		page_t *page = &pages[pageid];
-		insertinfreelist(page);
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	freerange(baseid, count);
+	MUTEX_RELEASE(&freelistmutex);
+}
+
+// the counters of the other cpus are read without synchronization, they are only statistics
+static void pmmkstat(kstatbuffer_t *buffer) {
+	kstat_printf(buffer, "pmm.freepages: %lu\n", freepagecount);
+	kstat_printf(buffer, "pmm.standbypages: %lu\n", standbypagecount);
+
+	for (int i = 0; i < (smp_cpus ? arch_smp_cpusawake : 1); ++i) {
+		cpu_t *cpu = smp_cpus ? smp_cpus[i] : current_cpu();
+		pmmcpucache_t *cache = &cpu->pmmcache;
+		kstat_printf(buffer, "pmm.cpu%d.cached: %lu\n", cpu->number, cache->count);
+		kstat_printf(buffer, "pmm.cpu%d.hits: %lu\n", cpu->number, cache->hits);
+		kstat_printf(buffer, "pmm.cpu%d.misses: %lu\n", cpu->number, cache->misses);
+		kstat_printf(buffer, "pmm.cpu%d.refills: %lu\n", cpu->number, cache->refills);
+		kstat_printf(buffer, "pmm.cpu%d.drains: %lu\n", cpu->number, cache->drains);
 	}
 }
 
@@ -255,15 +658,15 @@ void pmm_init() {
 	for (size_t i = 0; i < pmm_liminemap.response->entry_count; ++i) {
 		struct limine_memmap_entry *e = pmm_liminemap.response->entries[i];
 		if (e->type == LIMINE_MEMMAP_USABLE) {
-			int firstusablepage = e == biggest ? ROUND_UP(e->base + pagecount * sizeof(page_t), PAGE_SIZE) / PAGE_SIZE : e->base / PAGE_SIZE;
-			for (int i = firstusablepage; i < (e->base + e->length) / PAGE_SIZE; ++i) {
-				pages[i].flags |= PAGE_FLAGS_FREE;
-				insertinfreelist(&pages[i]);
-			}
+			uintmax_t firstusablepage = e == biggest ? ROUND_UP(e->base + pagecount * sizeof(page_t), PAGE_SIZE) / PAGE_SIZE : e->base / PAGE_SIZE;
+			uintmax_t toppage = (e->base + e->length) / PAGE_SIZE;
+			if (toppage > firstusablepage)
+				freerange(firstusablepage, toppage - firstusablepage);
 		}
 	}
 
 	MUTEX_INIT(&freelistmutex);
+	kstat_register(pmmkstat);
 }
 
 // XXX pmm_alloc won't be able to take pages from the page cache when the allocation size is over 1 page
@@ -274,36 +677,34 @@ void *pmm_alloc(size_t size, int section) {
 	if (size == 1)
 		return pmm_allocpage(section);
 
-	MUTEX_ACQUIRE(&freelistmutex, false);
-
-	uintmax_t page = 0;
-	size_t found = 0;
+	int order = log2(size);
+	if (((size_t)1 << order) < size)
+		++order;
 
-	for (; section >= 0; --section) {
-		for (page = sections[section].searchstart; page < sections[section].topid; ++page) {
-			if (page >= pagecount)
-				break;
+	size_t allocsize = (size_t)1 << order;
+	size_t blockcount = 0;
+	if (order > PMM_MAX_ORDER) {
+		blockcount = ROUND_UP(size, (size_t)1 << PMM_MAX_ORDER) >> PMM_MAX_ORDER;
+		allocsize = blockcount << PMM_MAX_ORDER;
+	}
 
-			if (pages[page].flags & PAGE_FLAGS_FREE) {
-				++found;
-			} else
-				found = 0;
+	MUTEX_ACQUIRE(&freelistmutex, false);
 
-			if (found == size)
-				goto gotpages;
-		}
-		found = 0;
-	}
+	page_t *page = NULL;
+	for (; section >= 0 && page == NULL; --section)
+		page = blockcount ? buddyallocrun(section, blockcount) : buddyalloc(section, order);
 
-	gotpages:
 	void *addr = NULL;
-	if (found == size) {
-		page = page - (found - 1);
-		addr = (void *)(page * PAGE_SIZE);
-		for (int i = 0; i < size; ++i) {
-			removefromfreelist(&pages[page + i]);
-			doalloc(&pages[page + i]);
-		}
+	if (page) {
+		uintmax_t pageid = PAGE_GETID(page);
+		addr = (void *)(pageid * PAGE_SIZE);
+
+		// give back the pages past the requested size
+		if (allocsize > size)
+			freerange(pageid + size, allocsize - size);
+
+		for (int i = 0; i < size; ++i)
+			doalloc(&pages[pageid + i]);
 	}
 
 	MUTEX_RELEASE(&freelistmutex);
@@ -312,8 +713,35 @@ void *pmm_alloc(size_t size, int section) {
 
 void pmm_free(void *addr, size_t size) {
 	__assert(size);
-	// release multiple pages at once
 	__assert(((uintptr_t)addr % PAGE_SIZE) == 0);
-	for (int i = 0; i < size; ++i)
-		pmm_release((void *)((uintptr_t)addr + PAGE_SIZE * i));
+	uintmax_t baseid = (uintptr_t)addr / PAGE_SIZE;
+	uintmax_t runstart = baseid;
+	size_t runcount = 0;
+
+	// release multiple pages at once, giving runs of unreferenced pages back to the buddy allocator directly
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	for (uintmax_t i = 0; i < size; ++i) {
+		page_t *page = &pages[baseid + i];
+		__assert(page->refcount != 0);
+
+		if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST) == 0) {
+			__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
+			if (page->backing == NULL) {
+				if (runcount == 0)
+					runstart = baseid + i;
+				++runcount;
+				continue;
+			}
+
+			insertinstandbylist(page);
+		}
+
+		if (runcount)
+			freerange(runstart, runcount);
+		runcount = 0;
+	}
+
+	if (runcount)
+		freerange(runstart, runcount);
+	MUTEX_RELEASE(&freelistmutex);
 }
@@ -1,7 +1,12 @@
 #include <kernel/slab.h>
 #include <kernel/vmm.h>
+#include <kernel/pmm.h>
 #include <logging.h>
 #include <util.h>
+#include <arch/cpu.h>
+#include <arch/smp.h>
+#include <semaphore.h>
+#include <kernel/scheduler.h>
 
 #define SLAB_INDIRECT_CUTOFF 512
 #define SLAB_INDIRECT_COUNT 16
@@ -14,15 +19,45 @@
 
 #define SLAB_DEBUG 0
 
+// at most one reclaim every RECLAIM_INTERVAL_US, no matter how often memory runs low
+#define RECLAIM_INTERVAL_US 1000000
+#define RECLAIM_PRIORITY 1
+
 // the cache responsible for allocating all others
 static bool selfcacheinit = false;
 static scache_t selfcache = {
 	.size = sizeof(scache_t),
 	.alignment = 8,
 	.truesize = ROUND_UP(sizeof(scache_t) + sizeof(void **), 8),
-	.slabobjcount = SLAB_DATA_SIZE / ROUND_UP(sizeof(scache_t) + sizeof(void **), 8)
+	.slabobjcount = SLAB_DATA_SIZE / ROUND_UP(sizeof(scache_t) + sizeof(void **), 8),
+	.flags = SLAB_FLAGS_NOMAGAZINE
 };
 
+// the cache responsible for allocating magazines
+static scache_t magazinecache = {
+	.size = sizeof(slabmagazine_t),
+	.alignment = 8,
+	.truesize = ROUND_UP(sizeof(slabmagazine_t) + sizeof(void **), 8),
+	.slabobjcount = SLAB_DATA_SIZE / ROUND_UP(sizeof(slabmagazine_t) + sizeof(void **), 8),
+	.flags = SLAB_FLAGS_NOMAGAZINE
+};
+
+// the cache responsible for allocating the per cpu magazine arrays, sized on first use
+static scache_t cpuarraycache = {
+	.flags = SLAB_FLAGS_NOMAGAZINE
+};
+
+static scache_t *cachelist;
+static mutex_t cachelistmutex;
+
+static void setsize(scache_t *cache, size_t size, size_t alignment) {
+	cache->size = size;
+	cache->alignment = alignment;
+	size_t freeptrsize = size < SLAB_INDIRECT_CUTOFF ? sizeof(void **) : 0;
+	cache->truesize = ROUND_UP(size + freeptrsize, alignment);
+	cache->slabobjcount = size < SLAB_INDIRECT_CUTOFF ? SLAB_DATA_SIZE / cache->truesize : SLAB_INDIRECT_COUNT;
+}
+
 static void initdirect(scache_t *cache, slab_t *slab, void *base) {
 	slab->free = NULL;
 	slab->used = 0;
@@ -52,11 +87,29 @@ static void initindirect(scache_t *cache, slab_t *slab, void **base, void *objba
 	}
 }
 
+// slabs keep a pointer to themselves in the page_t of every page holding their objects,
+// so the slab (and cache) an object belongs to can be found without searching the slab lists
+static void setslabpages(slab_t *slab, void *base, size_t size) {
+	for (uintmax_t offset = 0; offset < size; offset += PAGE_SIZE) {
+		void *physical = arch_mmu_getphysical(current_vmm_context()->pagetable, (void *)((uintptr_t)base + offset));
+		__assert(physical);
+		pmm_getpage(physical)->slab = slab;
+	}
+}
+
+static inline slab_t *getslab(void *obj) {
+	void *physical = arch_mmu_getphysical(current_vmm_context()->pagetable, (void *)ROUND_DOWN((uintptr_t)obj, PAGE_SIZE));
+	__assert(physical);
+	return pmm_getpage(physical)->slab;
+}
+
 static bool growcache(scache_t *cache) {
 	void *_slab = vmm_map(NULL, PAGE_SIZE, VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
 	if (_slab == NULL)
 		return false;
 	slab_t *slab = GET_SLAB(_slab);
+	slab->cache = cache;
+	setslabpages(slab, _slab, PAGE_SIZE);
 
 	if (cache->size < SLAB_INDIRECT_CUTOFF) {
 		initdirect(cache, slab, _slab);
@@ -67,8 +120,10 @@ static bool growcache(scache_t *cache) {
 			return false;
 		}
 		initindirect(cache, slab, _slab, base);
+		setslabpages(slab, base, cache->slabobjcount * cache->truesize);
 	}
 
+	++cache->slabcount;
 
 	slab->next = cache->empty;
 	slab->prev = NULL;
@@ -104,7 +159,7 @@ static void *takeobject(scache_t *cache, slab_t *slab) {
 		return (void *)((uintptr_t)slab->base + ((uintptr_t)objend - ROUND_DOWN((uintptr_t)slab, PAGE_SIZE)) / sizeof(void **) * cache->truesize);
 }
 
-// frees an object and returns the slab the object belongs to
+// frees an already destructed object and returns the slab the object belongs to
 static slab_t *returnobject(scache_t *cache, void *obj) {
 	slab_t *slab = NULL;
 	void **freeptr = NULL;
@@ -113,28 +168,14 @@ static slab_t *returnobject(scache_t *cache, void *obj) {
 		freeptr = (void **)((uintptr_t)obj + cache->size);
 		__assert(*freeptr == NULL);
 	} else {
-		bool partial = cache->full == NULL;
-		slab = partial ? cache->partial : cache->full;
-		while (slab) {
-			void *top = (void *)((uintptr_t)slab->base + cache->slabobjcount * cache->truesize);
-			if (obj >= slab->base && obj < top)
-				break;
-			if (slab->next == NULL && partial == false) {
-				slab = cache->partial;
-				partial = true;
-			} else {
-				slab = slab->next;
-			}
-		}
+		slab = getslab(obj);
 		__assert(slab);
+		__assert(obj >= slab->base && (uintptr_t)obj < (uintptr_t)slab->base + cache->slabobjcount * cache->truesize);
 		uintmax_t objn = ((uintptr_t)obj - (uintptr_t)slab->base) / cache->truesize;
 		void **base = (void **)ROUND_DOWN((uintptr_t)slab, PAGE_SIZE);
 		freeptr = &base[objn];
 	}
 
-	if (cache->dtor)
-		cache->dtor(cache, obj);
-
 	*freeptr = slab->free;
 	slab->free = freeptr;
 	--slab->used;
@@ -142,7 +183,7 @@ static slab_t *returnobject(scache_t *cache, void *obj) {
 	return slab;
 }
 
-void *slab_allocate(scache_t *cache) {
+static void *slaballocate(scache_t *cache) {
 	MUTEX_ACQUIRE(&cache->mutex, false);
 	slab_t *slab = NULL;
 	if (cache->partial != NULL)
@@ -191,9 +232,8 @@ void *slab_allocate(scache_t *cache) {
 	return ret;
 }
 
-void slab_free(scache_t *cache, void *addr) {
-	MUTEX_ACQUIRE(&cache->mutex, false);
-
+// expects cache->mutex to be held
+static void slabfree(scache_t *cache, void *addr) {
 	slab_t *slab = returnobject(cache, addr);
 	__assert(slab);
 
@@ -228,6 +268,166 @@ void slab_free(scache_t *cache, void *addr) {
 			slab->next->prev = slab;
 		cache->partial = slab;
 	}
+}
+
+// the magazine layer. the per cpu magazines are only accessed by their own cpu with the ipl
+// raised to IPL_DPC, and the depot is protected by a spinlock taken at the same ipl.
+
+static inline slabcpu_t *getcpu(scache_t *cache) {
+	if (cache->flags & SLAB_FLAGS_NOMAGAZINE)
+		return NULL;
+
+	__assert(current_cpu()->number < cache->cpucount);
+	return &cache->cpu[current_cpu()->number];
+}
+
+// gives the objects in a magazine back to their slabs. the ipl has to be IPL_NORMAL
+static void flushmagazine(scache_t *cache, slabmagazine_t *magazine) {
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	for (size_t i = 0; i < magazine->count; ++i)
+		slabfree(cache, magazine->objects[i]);
+	MUTEX_RELEASE(&cache->mutex);
+
+	magazine->count = 0;
+}
+
+static void depotputempty(scache_t *cache, slabmagazine_t *magazine) {
+	long oldipl = spinlock_acquireraiseipl(&cache->depotlock, IPL_DPC);
+	magazine->next = cache->depotempty;
+	cache->depotempty = magazine;
+	++cache->depotemptycount;
+	spinlock_releaseloweripl(&cache->depotlock, oldipl);
+}
+
+void *slab_allocate(scache_t *cache) {
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	slabcpu_t *cpu = getcpu(cache);
+	void *obj = NULL;
+
+	while (cpu) {
+		if (cpu->loaded && cpu->loaded->count) {
+			obj = cpu->loaded->objects[--cpu->loaded->count];
+			++cpu->allochits;
+			break;
+		}
+
+		if (cpu->previous && cpu->previous->count) {
+			slabmagazine_t *tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+			continue;
+		}
+
+		// both magazines are empty, exchange the previous one for a full one from the depot
+		spinlock_acquire(&cache->depotlock);
+		slabmagazine_t *full = cache->depotfull;
+		if (full) {
+			cache->depotfull = full->next;
+			--cache->depotfullcount;
+
+			if (cpu->previous) {
+				cpu->previous->next = cache->depotempty;
+				cache->depotempty = cpu->previous;
+				++cache->depotemptycount;
+			}
+
+			cpu->previous = cpu->loaded;
+			cpu->loaded = full;
+			++cache->depotexchanges;
+		}
+		spinlock_release(&cache->depotlock);
+
+		if (full == NULL) {
+			++cpu->allocmisses;
+			break;
+		}
+	}
+
+	interrupt_loweripl(oldipl);
+
+	if (obj == NULL)
+		obj = slaballocate(cache);
+
+	return obj;
+}
+
+void slab_free(scache_t *cache, void *addr) {
+	if (cache->dtor)
+		cache->dtor(cache, addr);
+
+	retry:
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	slabcpu_t *cpu = getcpu(cache);
+	slabmagazine_t *flush = NULL;
+	bool usemagazines = cpu != NULL;
+	bool freed = false;
+
+	while (cpu) {
+		if (cpu->loaded && cpu->loaded->count < SLAB_MAGAZINE_SIZE) {
+			cpu->loaded->objects[cpu->loaded->count++] = addr;
+			++cpu->freehits;
+			freed = true;
+			break;
+		}
+
+		if (cpu->previous && cpu->previous->count < SLAB_MAGAZINE_SIZE) {
+			slabmagazine_t *tmp = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = tmp;
+			continue;
+		}
+
+		// both magazines are full, exchange the previous one for an empty one from the depot
+		spinlock_acquire(&cache->depotlock);
+		slabmagazine_t *empty = cache->depotempty;
+		if (empty) {
+			cache->depotempty = empty->next;
+			--cache->depotemptycount;
+
+			if (cpu->previous && cache->depotfullcount < SLAB_DEPOT_MAXFULL) {
+				cpu->previous->next = cache->depotfull;
+				cache->depotfull = cpu->previous;
+				++cache->depotfullcount;
+			} else if (cpu->previous) {
+				// too many objects are cached in the depot already, give them back to the slabs
+				flush = cpu->previous;
+				++cache->depotflushes;
+			}
+
+			cpu->previous = cpu->loaded;
+			cpu->loaded = empty;
+			++cache->depotexchanges;
+		}
+		spinlock_release(&cache->depotlock);
+
+		if (empty == NULL) {
+			++cpu->freemisses;
+			break;
+		}
+	}
+
+	interrupt_loweripl(oldipl);
+
+	if (flush) {
+		flushmagazine(cache, flush);
+		depotputempty(cache, flush);
+	}
+
+	if (freed)
+		return;
+
+	if (usemagazines) {
+		// no empty magazines in the depot, allocate a new one and try again
+		slabmagazine_t *magazine = slab_allocate(&magazinecache);
+		if (magazine) {
+			magazine->count = 0;
+			depotputempty(cache, magazine);
+			goto retry;
+		}
+	}
+
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	slabfree(cache, addr);
 	MUTEX_RELEASE(&cache->mutex);
 }
 
@@ -238,57 +438,246 @@ scache_t *slab_newcache(size_t size, size_t alignment, void (*ctor)(scache_t *,
 	if (selfcacheinit == false) {
 		selfcacheinit = true;
 		MUTEX_INIT(&selfcache.mutex);
+		MUTEX_INIT(&magazinecache.mutex);
+		MUTEX_INIT(&cpuarraycache.mutex);
+		MUTEX_INIT(&cachelistmutex);
+		setsize(&cpuarraycache, sizeof(slabcpu_t) * arch_smp_cpucount(), 8);
 	}
 
 	scache_t *cache = slab_allocate(&selfcache);
 	if (cache == NULL)
 		return NULL;
 
-	cache->size = size;
-	cache->alignment = alignment;
-	size_t freeptrsize = size < SLAB_INDIRECT_CUTOFF ? sizeof(void **) : 0;
-	cache->truesize = ROUND_UP(size + freeptrsize, alignment);
+	cache->cpu = slab_allocate(&cpuarraycache);
+	if (cache->cpu == NULL) {
+		slab_free(&selfcache, cache);
+		return NULL;
+	}
+
+	setsize(cache, size, alignment);
 	cache->ctor = ctor;
 	cache->dtor = dtor;
-	cache->slabobjcount = size < SLAB_INDIRECT_CUTOFF ? SLAB_DATA_SIZE / cache->truesize : SLAB_INDIRECT_COUNT;
 	cache->full = NULL;
 	cache->empty = NULL;
 	cache->partial = NULL;
+	cache->slabcount = 0;
+	cache->flags = 0;
+	cache->depotfull = NULL;
+	cache->depotempty = NULL;
+	cache->depotfullcount = 0;
+	cache->depotemptycount = 0;
+	cache->depotexchanges = 0;
+	cache->depotflushes = 0;
+	cache->cpucount = arch_smp_cpucount();
+	memset(cache->cpu, 0, sizeof(slabcpu_t) * cache->cpucount);
+	SPINLOCK_INIT(cache->depotlock);
 	MUTEX_INIT(&cache->mutex);
 
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	cache->next = cachelist;
+	cachelist = cache;
+	MUTEX_RELEASE(&cachelistmutex);
+
 	printf("slab: new cache: size %lu align %lu truesize %lu objcount %lu\n", cache->size, cache->alignment, cache->truesize, cache->slabobjcount);
 
 	return cache;
 }
 
+// expects cache->mutex to be held
 static size_t purge(scache_t *cache, size_t maxcount){
-	slab_t *slab = cache->empty;
-	for (size_t done = 0; done < maxcount; ++done) {
-		if (slab == NULL)
-			return done;
-
-		slab_t *next = slab->next;
-		if (next)
-			next->prev = NULL;
+	size_t done = 0;
+	while (done < maxcount && cache->empty) {
+		slab_t *slab = cache->empty;
+		cache->empty = slab->next;
+		if (cache->empty)
+			cache->empty->prev = NULL;
 
 		if (cache->size >= SLAB_INDIRECT_CUTOFF)
 			vmm_unmap(slab->base, cache->slabobjcount * cache->truesize, 0);
 
 		vmm_unmap(slab, PAGE_SIZE, 0);
-
-		slab = cache->empty;
-		cache->empty = next;
+		--cache->slabcount;
+		++done;
 	}
 
-	return maxcount;
+	return done;
+}
+
+static void freemagazine(scache_t *cache, slabmagazine_t *magazine) {
+	if (magazine == NULL)
+		return;
+
+	flushmagazine(cache, magazine);
+	slab_free(&magazinecache, magazine);
 }
 
+// the cache must not be in use by any other cpu
 void slab_freecache(scache_t *cache) {
+	MUTEX_ACQUIRE(&cachelistmutex, false);
+	scache_t **link = &cachelist;
+	while (*link != cache)
+		link = &(*link)->next;
+	*link = cache->next;
+	MUTEX_RELEASE(&cachelistmutex);
+
+	for (size_t i = 0; i < cache->cpucount; ++i) {
+		freemagazine(cache, cache->cpu[i].loaded);
+		freemagazine(cache, cache->cpu[i].previous);
+	}
+
+	while (cache->depotfull) {
+		slabmagazine_t *magazine = cache->depotfull;
+		cache->depotfull = magazine->next;
+		freemagazine(cache, magazine);
+	}
+
+	while (cache->depotempty) {
+		slabmagazine_t *magazine = cache->depotempty;
+		cache->depotempty = magazine->next;
+		freemagazine(cache, magazine);
+	}
+
 	MUTEX_ACQUIRE(&cache->mutex, false);
 	__assert(cache->partial == NULL);
 	__assert(cache->full == NULL);
 
 	purge(cache, (size_t)-1);
 
+	slab_free(&cpuarraycache, cache->cpu);
 	slab_free(&selfcache, cache);
 }
+
+void slab_getstats(scache_t *cache, slabstats_t *stats) {
+	memset(stats, 0, sizeof(slabstats_t));
+
+	for (size_t i = 0; i < cache->cpucount; ++i) {
+		stats->allochits += cache->cpu[i].allochits;
+		stats->allocmisses += cache->cpu[i].allocmisses;
+		stats->freehits += cache->cpu[i].freehits;
+		stats->freemisses += cache->cpu[i].freemisses;
+	}
+
+	long oldipl = spinlock_acquireraiseipl(&cache->depotlock, IPL_DPC);
+	stats->depotexchanges = cache->depotexchanges;
+	stats->depotflushes = cache->depotflushes;
+	stats->depotfull = cache->depotfullcount;
+	stats->depotempty = cache->depotemptycount;
+	for (slabmagazine_t *magazine = cache->depotfull; magazine; magazine = magazine->next)
+		stats->cachedobjects += magazine->count;
+	spinlock_releaseloweripl(&cache->depotlock, oldipl);
+
+	// the other cpus might be changing their magazines while this runs, so this is only an estimate
+	for (size_t i = 0; i < cache->cpucount; ++i) {
+		slabmagazine_t *loaded = cache->cpu[i].loaded;
+		slabmagazine_t *previous = cache->cpu[i].previous;
+		stats->cachedobjects += (loaded ? loaded->count : 0) + (previous ? previous->count : 0);
+	}
+
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	stats->slabs = cache->slabcount;
+	stats->objects = cache->slabcount * cache->slabobjcount;
+	for (slab_t *slab = cache->full; slab; slab = slab->next)
+		stats->usedobjects += slab->used;
+	for (slab_t *slab = cache->partial; slab; slab = slab->next)
+		stats->usedobjects += slab->used;
+	MUTEX_RELEASE(&cache->mutex);
+}
+
+// returns the cache an object allocated with slab_allocate belongs to
+scache_t *slab_getcache(void *obj) {
+	slab_t *slab = getslab(obj);
+	__assert(slab);
+	return slab->cache;
+}
+
+static semaphore_t reclaimsem;
+static bool reclaimready;
+
+// gives the magazines of the current cpu back to the slabs
+static void draincpu(scache_t *cache) {
+	long oldipl = interrupt_raiseipl(IPL_DPC);
+	slabcpu_t *cpu = getcpu(cache);
+	slabmagazine_t *loaded = cpu ? cpu->loaded : NULL;
+	slabmagazine_t *previous = cpu ? cpu->previous : NULL;
+	if (cpu) {
+		cpu->loaded = NULL;
+		cpu->previous = NULL;
+	}
+	interrupt_loweripl(oldipl);
+
+	freemagazine(cache, loaded);
+	freemagazine(cache, previous);
+}
+
+// gives the magazines in the depot back to the slabs and frees the empty slabs
+static void draindepot(scache_t *cache) {
+	long oldipl = spinlock_acquireraiseipl(&cache->depotlock, IPL_DPC);
+	slabmagazine_t *full = cache->depotfull;
+	slabmagazine_t *empty = cache->depotempty;
+	cache->depotfull = NULL;
+	cache->depotempty = NULL;
+	cache->depotfullcount = 0;
+	cache->depotemptycount = 0;
+	spinlock_releaseloweripl(&cache->depotlock, oldipl);
+
+	while (full) {
+		slabmagazine_t *next = full->next;
+		freemagazine(cache, full);
+		full = next;
+	}
+
+	while (empty) {
+		slabmagazine_t *next = empty->next;
+		freemagazine(cache, empty);
+		empty = next;
+	}
+
+	MUTEX_ACQUIRE(&cache->mutex, false);
+	purge(cache, (size_t)-1);
+	MUTEX_RELEASE(&cache->mutex);
+}
+
+// the magazines of a cpu are only accessed by the cpu itself, so the thread moves to every cpu to drain them
+static void reclaimthread() {
+	for (;;) {
+		semaphore_wait(&reclaimsem, false);
+
+		MUTEX_ACQUIRE(&cachelistmutex, false);
+		for (size_t i = 0; i < (smp_cpus ? arch_smp_cpucount() : 1); ++i) {
+			cpu_t *cpu = smp_cpus ? smp_cpus[i] : current_cpu();
+			// with nosmp, the cpus which were never woken up have no scheduler set up
+			if (cpu->reschedule_isr == NULL)
+				continue;
+
+			sched_reschedule_on_cpu(cpu, true);
+			for (scache_t *cache = cachelist; cache; cache = cache->next)
+				draincpu(cache);
+		}
+		sched_target_cpu(NULL);
+
+		for (scache_t *cache = cachelist; cache; cache = cache->next)
+			draindepot(cache);
+		MUTEX_RELEASE(&cachelistmutex);
+
+		MUTEX_ACQUIRE(&magazinecache.mutex, false);
+		purge(&magazinecache, (size_t)-1);
+		MUTEX_RELEASE(&magazinecache.mutex);
+
+		sched_sleep_us(RECLAIM_INTERVAL_US);
+	}
+}
+
+// called by the pmm when its free lists run out. the reclaim is done later by its own thread,
+// as the caller could be holding the mutex of a cache
+void slab_lowmemory() {
+	if (__atomic_load_n(&reclaimready, __ATOMIC_ACQUIRE))
+		semaphore_signal_limit(&reclaimsem, 1);
+}
+
+void slab_reclaiminit() {
+	SEMAPHORE_INIT(&reclaimsem, 0);
+	thread_t *thread = sched_newthread(reclaimthread, PAGE_SIZE * 4, RECLAIM_PRIORITY, NULL, NULL);
+	__assert(thread);
+	sched_queue(thread);
+	__atomic_store_n(&reclaimready, true, __ATOMIC_RELEASE);
+}
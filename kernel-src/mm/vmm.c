@@ -7,9 +7,16 @@
 #include <string.h>
 #include <kernel/slab.h>
 #include <kernel/vmmcache.h>
+#include <kernel/kstat.h>
 
 #define RANGE_TOP(x) (void *)((uintptr_t)x->start + x->size)
 
+#define SPACE_WRITELOCK(s) RWLOCK_ACQUIREWRITE(&(s)->lock)
+#define SPACE_WRITEUNLOCK(s) { \
+		++(s)->generation; \
+		RWLOCK_RELEASEWRITE(&(s)->lock); \
+	}
+
 static vmmcache_t *newcache() {
 	vmmcache_t *ptr = pmm_allocpage(PMM_SECTION_DEFAULT);
 	if (ptr == NULL)
@@ -95,49 +102,256 @@ static vmmspace_t *getspace(void *vaddr) {
 }
 
 
+// the AVL tree nodes cache their height and the biggest free gap found in their subtree.
+// the gap of a range is the free space between it and the range before it (or the start of the space)
+
+static inline int nodeheight(vmmrange_t *node) {
+	return node ? node->height : 0;
+}
+
+static inline size_t nodemaxgap(vmmrange_t *node) {
+	return node ? node->maxgap : 0;
+}
+
+static void nodeupdate(vmmrange_t *node) {
+	int leftheight = nodeheight(node->left);
+	int rightheight = nodeheight(node->right);
+	node->height = 1 + (leftheight > rightheight ? leftheight : rightheight);
+
+	size_t maxgap = node->gap;
+	if (nodemaxgap(node->left) > maxgap)
+		maxgap = nodemaxgap(node->left);
+	if (nodemaxgap(node->right) > maxgap)
+		maxgap = nodemaxgap(node->right);
+	node->maxgap = maxgap;
+}
+
+static void replacechild(vmmspace_t *space, vmmrange_t *parent, vmmrange_t *old, vmmrange_t *new) {
+	if (parent == NULL)
+		space->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	if (new)
+		new->parent = parent;
+}
+
+static vmmrange_t *rotateleft(vmmspace_t *space, vmmrange_t *node) {
+	vmmrange_t *right = node->right;
+	replacechild(space, node->parent, node, right);
+	node->right = right->left;
+	if (node->right)
+		node->right->parent = node;
+
+	right->left = node;
+	node->parent = right;
+	nodeupdate(node);
+	nodeupdate(right);
+	return right;
+}
+
+static vmmrange_t *rotateright(vmmspace_t *space, vmmrange_t *node) {
+	vmmrange_t *left = node->left;
+	replacechild(space, node->parent, node, left);
+	node->left = left->right;
+	if (node->left)
+		node->left->parent = node;
+
+	left->right = node;
+	node->parent = left;
+	nodeupdate(node);
+	nodeupdate(left);
+	return left;
+}
+
+// walks from node up to the root fixing up the cached values and rebalancing
+static void rebalance(vmmspace_t *space, vmmrange_t *node) {
+	while (node) {
+		nodeupdate(node);
+		int balance = nodeheight(node->left) - nodeheight(node->right);
+		if (balance > 1) {
+			if (nodeheight(node->left->left) < nodeheight(node->left->right))
+				rotateleft(space, node->left);
+			node = rotateright(space, node);
+		} else if (balance < -1) {
+			if (nodeheight(node->right->right) < nodeheight(node->right->left))
+				rotateright(space, node->right);
+			node = rotateleft(space, node);
+		}
+		node = node->parent;
+	}
+}
+
+// recalculates the gap before a range after it or its previous range changed
+static void updategap(vmmspace_t *space, vmmrange_t *range) {
+	void *gapstart = range->prev ? RANGE_TOP(range->prev) : space->start;
+	range->gap = (uintptr_t)range->start - (uintptr_t)gapstart;
+	rebalance(space, range);
+}
+
+// called after the start or size of a range was changed without changing its position in the space
+static void rangeresized(vmmspace_t *space, vmmrange_t *range) {
+	updategap(space, range);
+	if (range->next)
+		updategap(space, range->next);
+}
+
+// inserts a range into the tree and the sorted list
+static void treeinsert(vmmspace_t *space, vmmrange_t *newrange) {
+	vmmrange_t *parent = NULL;
+	vmmrange_t **link = &space->root;
+	vmmrange_t *prev = NULL;
+	vmmrange_t *next = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (newrange->start < parent->start) {
+			next = parent;
+			link = &parent->left;
+		} else {
+			prev = parent;
+			link = &parent->right;
+		}
+	}
+
+	newrange->left = NULL;
+	newrange->right = NULL;
+	newrange->parent = parent;
+	newrange->height = 1;
+	*link = newrange;
+
+	newrange->prev = prev;
+	newrange->next = next;
+	if (prev)
+		prev->next = newrange;
+	else
+		space->ranges = newrange;
+
+	if (next)
+		next->prev = newrange;
+
+	updategap(space, newrange);
+	if (next)
+		updategap(space, next);
+}
+
+// removes a range from the tree and the sorted list
+static void treeremove(vmmspace_t *space, vmmrange_t *range) {
+	vmmrange_t *next = range->next;
+	vmmrange_t *rebalancefrom;
+
+	if (range->prev)
+		range->prev->next = range->next;
+	else
+		space->ranges = range->next;
+
+	if (range->next)
+		range->next->prev = range->prev;
+
+	if (range->left && range->right) {
+		// replace it with the in order successor, which is the next range
+		vmmrange_t *successor = next;
+		__assert(successor && successor->left == NULL);
+		if (successor->parent == range) {
+			rebalancefrom = successor;
+		} else {
+			rebalancefrom = successor->parent;
+			replacechild(space, successor->parent, successor, successor->right);
+			successor->right = range->right;
+			successor->right->parent = successor;
+		}
+
+		replacechild(space, range->parent, range, successor);
+		successor->left = range->left;
+		successor->left->parent = successor;
+	} else {
+		rebalancefrom = range->parent;
+		replacechild(space, range->parent, range, range->left ? range->left : range->right);
+	}
+
+	rebalance(space, rebalancefrom);
+	if (next)
+		updategap(space, next);
+}
+
 // get a range from an address
 static vmmrange_t *getrange(vmmspace_t *space, void *addr) {
-	vmmrange_t *range = space->ranges;
+	vmmrange_t *range = space->root;
 	while (range) {
-		if (addr >= range->start && addr < RANGE_TOP(range))
+		if (addr < range->start)
+			range = range->left;
+		else if (addr >= RANGE_TOP(range))
+			range = range->right;
+		else
 			break;
-		range = range->next;
 	}
 	return range;
 }
 
+// get the first range which ends after addr
+static vmmrange_t *getfirstrange(vmmspace_t *space, void *addr) {
+	vmmrange_t *node = space->root;
+	vmmrange_t *found = NULL;
+	while (node) {
+		if (RANGE_TOP(node) > addr) {
+			found = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return found;
+}
+
+// get the lowest range after the address after with a gap of at least size before it
+static vmmrange_t *findgap(vmmrange_t *node, void *after, size_t size) {
+	if (node == NULL || node->maxgap < size)
+		return NULL;
+
+	if (node->start > after) {
+		vmmrange_t *found = findgap(node->left, after, size);
+		if (found)
+			return found;
+
+		if (node->gap >= size)
+			return node;
+	}
+
+	return findgap(node->right, after, size);
+}
+
 // get start of range that fits specific size from specific offset
 static void *getfreerange(vmmspace_t *space, void *addr, size_t size) {
-	vmmrange_t *range = space->ranges;
 	if (addr == NULL)
 		addr = space->start;
 
-	// if theres no ranges
-	if (range == NULL)
-		return addr;
+	// skip past the range addr is in, if any
+	vmmrange_t *next = getfirstrange(space, addr);
+	if (next && next->start <= addr) {
+		addr = RANGE_TOP(next);
+		next = next->next;
+	}
 
-	// if theres free space before the first range
-	if (range->start != space->start && addr < range->start && (uintptr_t)range->start - (uintptr_t)addr >= size)
-		return addr;
+	if (next) {
+		// if theres free space between addr and the next range
+		if ((uintptr_t)next->start - (uintptr_t)addr >= size)
+			return addr;
 
-	while (range->next) {
-		void *rangetop = RANGE_TOP(range);
-		if (addr < rangetop)
-			addr = rangetop;
+		vmmrange_t *range = findgap(space->root, next->start, size);
+		if (range)
+			return RANGE_TOP(range->prev);
 
-		if (addr < range->next->start) {
-			size_t freesize = (uintptr_t)range->next->start - (uintptr_t)addr;
-			if (freesize >= size)
-				return addr;
-		}
-		range = range->next;
+		// find the last range
+		next = space->root;
+		while (next->right)
+			next = next->right;
+
+		addr = RANGE_TOP(next);
 	}
 
 	// if theres free space after the last range
-	void *rangetop = RANGE_TOP(range);
-	if (addr < rangetop)
-		addr = rangetop;
-
 	if (addr != space->end && (uintptr_t)space->end - (uintptr_t)addr >= size)
 		return addr;
 
@@ -145,51 +359,16 @@ static void *getfreerange(vmmspace_t *space, void *addr, size_t size) {
 }
 
 static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
-	vmmrange_t *range = space->ranges;
-
-	// space has no other ranges
-	if (range == NULL) {
-		space->ranges = newrange;
-		newrange->next = NULL;
-		newrange->prev = NULL;
-		return;
-	}
-
+	treeinsert(space, newrange);
 	void *newrangetop = RANGE_TOP(newrange);
 
-	// range is before the first space range
-	if (newrangetop <= range->start) {
-		space->ranges = newrange;
-		newrange->next = range;
-		range->prev = newrange;
-		newrange->prev = NULL;
-		goto fragcheck;
-	}
-
-	while (range->next) {
-		if (newrange->start >= RANGE_TOP(range) && newrange->start < range->next->start) { // space inbetween two other ranges
-			newrange->next = range->next;
-			newrange->prev = range;
-			range->next = newrange;
-			goto fragcheck;
-		}
-		range = range->next;
-	}
-
-	// space after the second range
-	range->next = newrange;
-	newrange->prev = range;
-	newrange->next = NULL;
-
-	fragcheck:
 	// join new range and the next
 	if (newrange->next && newrange->next->start == newrangetop && newrange->flags == newrange->next->flags && newrange->mmuflags == newrange->next->mmuflags
 		&& ((newrange->flags & VMM_FLAGS_FILE) == 0 || (newrange->vnode == newrange->next->vnode && newrange->offset + newrange->size == newrange->next->offset))) {
 		vmmrange_t *oldrange = newrange->next;
+		treeremove(space, oldrange);
 		newrange->size += oldrange->size;
-		newrange->next = oldrange->next;
-		if (oldrange->next)
-			oldrange->next->prev = newrange;
+		rangeresized(space, newrange);
 
 		freerange(oldrange);
 		if (newrange->flags & VMM_FLAGS_FILE) {
@@ -201,11 +380,9 @@ static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
 	if (newrange->prev && RANGE_TOP(newrange->prev) == newrange->start && newrange->flags == newrange->prev->flags && newrange->mmuflags == newrange->prev->mmuflags
 		&& ((newrange->flags & VMM_FLAGS_FILE) == 0 || (newrange->vnode == newrange->prev->vnode && newrange->prev->offset + newrange->prev->size == newrange->offset))) {
 		vmmrange_t *oldrange = newrange->prev;
+		treeremove(space, newrange);
 		oldrange->size += newrange->size;
-		oldrange->next = newrange->next;
-
-		if (newrange->next)
-			newrange->next->prev = oldrange;
+		rangeresized(space, oldrange);
 
 		freerange(newrange);
 		if (oldrange->flags & VMM_FLAGS_FILE) {
@@ -214,6 +391,39 @@ static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
 	}
 }
 
+#define HUGEPAGE_SIZE ARCH_MMU_LARGEPAGE_SIZE
+#define HUGEPAGE_PAGES (HUGEPAGE_SIZE / PAGE_SIZE)
+
+static uintmax_t hugepagehits;
+static uintmax_t hugepagefallbacks;
+static uintmax_t hugepagesplits;
+
+static void hugepagekstat(kstatbuffer_t *buffer) {
+	kstat_printf(buffer, "vmm.hugepage.hits: %lu\n", hugepagehits);
+	kstat_printf(buffer, "vmm.hugepage.fallbacks: %lu\n", hugepagefallbacks);
+	kstat_printf(buffer, "vmm.hugepage.splits: %lu\n", hugepagesplits);
+}
+
+// only private anonymous userspace memory is backed by huge pages
+static inline bool hugeable(vmmspace_t *space, int flags) {
+	return space != &kernelspace && (flags & (VMM_FLAGS_FILE | VMM_FLAGS_SHARED | VMM_FLAGS_PHYSICAL)) == 0;
+}
+
+// splits the huge page mapped at addr (if any) into normal pages. the new entries translate the same way,
+// and the caller's invalidation of any page inside of the huge page drops the old tlb entry for all of it.
+// expects the space to be write locked or the map lock to be held
+static bool splithuge(void *addr) {
+	pagetableptr_t pagetable = current_vmm_context()->pagetable;
+	if (arch_mmu_islarge(pagetable, addr) == false)
+		return true;
+
+	if (arch_mmu_splitlarge(pagetable, addr) == false)
+		return false;
+
+	__atomic_add_fetch(&hugepagesplits, 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
 static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int flags) {
 	uintmax_t top = _offset + size;
 
@@ -223,6 +433,17 @@ static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int
 		if (physical == NULL)
 			continue;
 
+		if (arch_mmu_islarge(current_vmm_context()->pagetable, vaddr)) {
+			// changemap split the huge pages crossing the edges, so this one goes away as a whole
+			__assert(((uintptr_t)vaddr % HUGEPAGE_SIZE) == 0 && offset + HUGEPAGE_SIZE <= top);
+			arch_mmu_unmap(current_vmm_context()->pagetable, vaddr);
+			for (uintmax_t i = 0; i < HUGEPAGE_PAGES; ++i)
+				pmm_release((void *)((uintptr_t)physical + i * PAGE_SIZE));
+
+			offset += HUGEPAGE_SIZE - PAGE_SIZE;
+			continue;
+		}
+
 		thread_t *thread = current_thread();
 		proc_t *proc = thread ? thread->proc : NULL;
 		cred_t *cred = proc ? &proc->cred : NULL;
@@ -262,7 +483,11 @@ static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int
 	if (((n) & (f)) == 0 && ((c) & (f))) \
 			m |= f;
 
-static void changemmurange(vmmrange_t *range, void *base, size_t size, mmuflags_t newflags) {
+// pages which had their permissions decreased are added to batch, to be invalidated by the caller
+static void changemmurange(vmmrange_t *range, void *base, size_t size, mmuflags_t newflags, mmutlbbatch_t *batch) {
+	void *changedstart = NULL;
+	void *changedtop = NULL;
+
 	for (uintmax_t offset = 0; offset < size; offset += PAGE_SIZE) {
 		void *address = (void *)((uintptr_t)base + offset);
 
@@ -292,8 +517,18 @@ static void changemmurange(vmmrange_t *range, void *base, size_t size, mmuflags_
 		// we will only change the mapping if the permissions decreased
 		if (mask) {
 			arch_mmu_remap(current_vmm_context()->pagetable, physical, address, currentflags & ~mask);
+			if (changedstart == NULL)
+				changedstart = address;
+			changedtop = (void *)((uintptr_t)address + PAGE_SIZE);
 		}
+
+		// a huge page is fully inside of the changed area and was remapped as a whole
+		if (arch_mmu_islarge(current_vmm_context()->pagetable, address))
+			offset += HUGEPAGE_SIZE - PAGE_SIZE;
 	}
+
+	if (changedstart)
+		arch_mmu_batchadd(batch, changedstart, (uintptr_t)changedtop - (uintptr_t)changedstart);
 }
 
 static inline bool canwritevnode(vmmrange_t *range) {
@@ -303,9 +538,30 @@ static inline bool canwritevnode(vmmrange_t *range) {
 	return error == 0;
 }
 
-static int changemap(vmmspace_t *space, void *address, size_t size, bool free, int flags, mmuflags_t newmmuflags) {
+// whether a protection change asked for by userspace has to be refused
+static bool credcheckfail(vmmrange_t *range, int flags, mmuflags_t newmmuflags) {
+	if ((flags & VMM_FLAGS_CREDCHECK) == 0)
+		return false;
+
+	if ((range->flags & VMM_FLAGS_READONLY) && (newmmuflags & ARCH_MMU_FLAGS_WRITE))
+		return true;
+
+	return (range->flags & VMM_FLAGS_SHARED) && (range->flags & VMM_FLAGS_FILE) && canwritevnode(range) == false;
+}
+
+// when not freeing, the pages that need to be invalidated are added to batch
+static int changemap(vmmspace_t *space, void *address, size_t size, bool free, int flags, mmuflags_t newmmuflags, mmutlbbatch_t *batch) {
 	void *top = (void *)((uintptr_t)address + size);
-	vmmrange_t *range = space->ranges;
+
+	// huge pages only partially inside of the change are split first
+	if (space != &kernelspace) {
+		if (((uintptr_t)address % HUGEPAGE_SIZE) && splithuge(address) == false)
+			return ENOMEM;
+		if (((uintptr_t)top % HUGEPAGE_SIZE) && splithuge(top) == false)
+			return ENOMEM;
+	}
+
+	vmmrange_t *range = getfirstrange(space, address);
 	vmmrange_t *newrange = NULL;
 	// allocated here and as soon as its used to make sure that 
 	// even in an allocation failure there will always be a valid mapping
@@ -325,30 +581,21 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 		if (range->start >= address && rangetop <= top) {
 			// completely changed
 			if (free) {
-				if (range->prev)
-					range->prev->next = range->next;
-				else
-					space->ranges = range->next;
-
-				if (range->next)
-					range->next->prev = range->prev;
-
+				treeremove(space, range);
 				destroyrange(range, 0, range->size, 0);
 				freerange(range);
 			} else {
-				if ((flags & VMM_FLAGS_CREDCHECK) && (range->flags & VMM_FLAGS_SHARED) &&
-					(range->flags & VMM_FLAGS_FILE) && canwritevnode(range) == false) {
+				if (credcheckfail(range, flags, newmmuflags)) {
 					error = EACCES;
 					goto leave;
 				}
 
-				changemmurange(range, range->start, range->size, newmmuflags);
+				changemmurange(range, range->start, range->size, newmmuflags, batch);
 				range->mmuflags = newmmuflags;
 			}
 		} else if (address > range->start && top < rangetop) {
 			// split (entire change was within a single range)
-			if (free == false && (flags & VMM_FLAGS_CREDCHECK) && (range->flags & VMM_FLAGS_SHARED) && 
-				(range->flags & VMM_FLAGS_FILE) && canwritevnode(range) == false) {
+			if (free == false && credcheckfail(range, flags, newmmuflags)) {
 				error = EACCES;
 				goto leave;
 			}
@@ -369,12 +616,8 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 			new->size = (uintptr_t)rangetop - (uintptr_t)new->start;
 			range->size = (uintptr_t)address - (uintptr_t)range->start;
 
-			if (range->next)
-				range->next->prev = new;
-
-			// new->next is set by the copy in *new = *range
-			new->prev = range;
-			range->next = new;
+			rangeresized(space, range);
+			treeinsert(space, new);
 
 			if (range->flags & VMM_FLAGS_FILE) {
 				VOP_HOLD(range->vnode);
@@ -387,7 +630,7 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 				newrange->flags = range->flags;
 				newrange->mmuflags = newmmuflags;
 
-				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags);
+				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags, batch);
 
 				if (range->flags & VMM_FLAGS_FILE) {
 					newrange->vnode = range->vnode;
@@ -404,8 +647,7 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 			}
 		} else if (top > range->start && range->start >= address) {
 			// partially change from start (end of change was within this range)
-			if (free == false && (flags & VMM_FLAGS_CREDCHECK) && (range->flags & VMM_FLAGS_SHARED) && 
-				(range->flags & VMM_FLAGS_FILE) && canwritevnode(range) == false) {
+			if (free == false && credcheckfail(range, flags, newmmuflags)) {
 				error = EACCES;
 				goto leave;
 			}
@@ -416,6 +658,7 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 			}
 			range->start = (void *)((uintptr_t)range->start + difference);
 			range->size -= difference;
+			rangeresized(space, range);
 
 			if (range->flags & VMM_FLAGS_FILE)
 				range->offset += difference;
@@ -426,7 +669,7 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 				newrange->flags = range->flags;
 				newrange->mmuflags = newmmuflags;
 
-				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags);
+				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags, batch);
 
 				if (range->flags & VMM_FLAGS_FILE) {
 					newrange->vnode = range->vnode;
@@ -443,14 +686,14 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 			}
 		} else if (address < rangetop && rangetop <= top) {
 			// partially change from end (start of change was within this range)
-			if (free == false && (flags & VMM_FLAGS_CREDCHECK) && (range->flags & VMM_FLAGS_SHARED) &&
-				(range->flags & VMM_FLAGS_FILE) && canwritevnode(range) == false) {
+			if (free == false && credcheckfail(range, flags, newmmuflags)) {
 				error = EACCES;
 				goto leave;
 			}
 
 			size_t difference = (uintptr_t)rangetop - (uintptr_t)address;
 			range->size -= difference;
+			rangeresized(space, range);
 			if (free) {
 				destroyrange(range, range->size, difference, 0);
 			} else {
@@ -459,7 +702,7 @@ static int changemap(vmmspace_t *space, void *address, size_t size, bool free, i
 				newrange->flags = range->flags;
 				newrange->mmuflags = newmmuflags;
 
-				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags);
+				changemmurange(range, newrange->start, newrange->size, newrange->mmuflags, batch);
 
 				if (range->flags & VMM_FLAGS_FILE) {
 					newrange->vnode = range->vnode;
@@ -501,12 +744,13 @@ int vmm_changemmuflags(void *base, size_t size, mmuflags_t mmuflags, int flags)
 	if (space == NULL)
 		return ENOMEM;
 
-	MUTEX_ACQUIRE(&space->lock, false);
+	SPACE_WRITELOCK(space);
 
-	int error = changemap(space, base, size, false, flags, mmuflags);
-	arch_mmu_invalidate_range(base, size);
+	mmutlbbatch_t batch = {0};
+	int error = changemap(space, base, size, false, flags, mmuflags, &batch);
+	arch_mmu_invalidate_batch(&batch);
 
-	MUTEX_RELEASE(&space->lock);
+	SPACE_WRITEUNLOCK(space);
 	return error;
 }
 
@@ -521,22 +765,127 @@ static void printspace(vmmspace_t *space) {
 
 static void *zeropage;
 
-bool vmm_pagefault(void *addr, bool user, int actions) {
-	if (user == false && addr > USERSPACE_END) {
-		printf("vmm: kernel access\n");
+#define FAULTAROUND_PAGES 16
+
+// maps the pages around addr which are already in the page cache, so touching them later won't fault.
+// expects the space to be read locked and the map lock to be held
+static void faultaround(vmmrange_t *range, void *addr, mmuflags_t mmuflags) {
+	void *start = (void *)ROUND_DOWN((uintptr_t)addr, FAULTAROUND_PAGES * PAGE_SIZE);
+	void *top = (void *)((uintptr_t)start + FAULTAROUND_PAGES * PAGE_SIZE);
+	if (start < range->start)
+		start = range->start;
+	if (top > RANGE_TOP(range))
+		top = RANGE_TOP(range);
+
+	for (void *vaddr = start; vaddr < top; vaddr = (void *)((uintptr_t)vaddr + PAGE_SIZE)) {
+		if (vaddr == addr || arch_mmu_ispresent(current_vmm_context()->pagetable, vaddr))
+			continue;
+
+		page_t *page = vmmcache_trygetpage(range->vnode, range->offset + ((uintptr_t)vaddr - (uintptr_t)range->start));
+		if (page == NULL)
+			continue;
+
+		if (arch_mmu_map(current_vmm_context()->pagetable, pmm_getpageaddress(page), vaddr, mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false) {
+			pmm_release(pmm_getpageaddress(page));
+			break;
+		}
+	}
+}
+
+// faults that can't be satisfied send a SIGBUS to the thread, unless the fault is from populating a mapping
+static bool faultsigbus(bool populate) {
+	if (populate)
+		return false;
+
+	signal_signalthread(current_thread(), SIGBUS, true);
+	return true;
+}
+
+// backs the aligned 2M area around addr with a huge page, if it is fully inside of the range and nothing
+// was mapped there yet. returns false if a normal page should be used instead.
+// expects the space to be read locked
+static bool hugefault(vmmspace_t *space, vmmrange_t *range, void *addr) {
+	pagetableptr_t pagetable = current_vmm_context()->pagetable;
+	void *base = (void *)ROUND_DOWN((uintptr_t)addr, HUGEPAGE_SIZE);
+	if (hugeable(space, range->flags) == false || base < range->start || (uintptr_t)base + HUGEPAGE_SIZE > (uintptr_t)RANGE_TOP(range)
+		|| arch_mmu_canmaplarge(pagetable, base) == false)
+		return false;
+
+	void *physical = pmm_alloc(HUGEPAGE_PAGES, PMM_SECTION_DEFAULT);
+	if (physical == NULL) {
+		__atomic_add_fetch(&hugepagefallbacks, 1, __ATOMIC_SEQ_CST);
 		return false;
 	}
 
-	addr = (void *)ROUND_DOWN((uintptr_t)addr, PAGE_SIZE);
+	memset(MAKE_HHDM(physical), 0, HUGEPAGE_SIZE);
 
-	vmmspace_t *space = getspace(addr);
+	MUTEX_ACQUIRE(&space->maplock, false);
+	// another thread could have mapped a page in the area in the meantime
+	bool mapped = arch_mmu_maplarge(pagetable, physical, base, range->mmuflags);
+	MUTEX_RELEASE(&space->maplock);
 
-	if (space == NULL || (space == &kernelspace && user)) {
-		printf("vmm: no such space or space accessed is kerneç\n");
+	if (mapped == false) {
+		pmm_free(physical, HUGEPAGE_PAGES);
+		__atomic_add_fetch(&hugepagefallbacks, 1, __ATOMIC_SEQ_CST);
 		return false;
 	}
 
-	MUTEX_ACQUIRE(&space->lock, false);
+	__atomic_add_fetch(&hugepagehits, 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+#define ANON_FAULTAROUND_PAGES 8
+
+// maps a zeroed page for the first write to a page of anonymous memory. if the page before it was
+// already written to the access is assumed to be sequential, and the next few pages are mapped too.
+// expects the space to be read locked
+static bool anonwritefault(vmmspace_t *space, vmmrange_t *range, void *addr, bool populate) {
+	if (hugefault(space, range, addr))
+		return true;
+
+	pagetableptr_t pagetable = current_vmm_context()->pagetable;
+	void *top = (void *)((uintptr_t)addr + PAGE_SIZE);
+	void *prev = (void *)((uintptr_t)addr - PAGE_SIZE);
+	if (prev >= range->start && arch_mmu_iswritable(pagetable, prev)) {
+		top = (void *)((uintptr_t)addr + ANON_FAULTAROUND_PAGES * PAGE_SIZE);
+		if (top > RANGE_TOP(range))
+			top = RANGE_TOP(range);
+	}
+
+	bool status = true;
+	MUTEX_ACQUIRE(&space->maplock, false);
+
+	for (void *vaddr = addr; vaddr < top; vaddr = (void *)((uintptr_t)vaddr + PAGE_SIZE)) {
+		// either another thread got to the page first or the sequential run ended
+		if (arch_mmu_ispresent(pagetable, vaddr))
+			break;
+
+		void *physical = pmm_allocpagezeroed(PMM_SECTION_DEFAULT);
+		if (physical == NULL) {
+			if (vaddr == addr) {
+				printf("vmm: out of memory for anonymous page (sending SIGBUS)\n");
+				status = faultsigbus(populate);
+			}
+			break;
+		}
+
+		if (arch_mmu_map(pagetable, physical, vaddr, range->mmuflags) == false) {
+			pmm_release(physical);
+			if (vaddr == addr) {
+				printf("vmm: out of memory to map anonymous page into address space (sending SIGBUS)\n");
+				status = faultsigbus(populate);
+			}
+			break;
+		}
+	}
+
+	MUTEX_RELEASE(&space->maplock);
+	return status;
+}
+
+static bool fault(vmmspace_t *space, void *addr, int actions, bool populate) {
+	retry:
+	RWLOCK_ACQUIREREAD(&space->lock);
 	vmmrange_t *range = getrange(space, addr);
 
 	bool status = false;
@@ -574,44 +923,90 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 			uintmax_t mapoffset = (uintptr_t)addr - (uintptr_t)range->start;
 			if (vfs_iscacheable(range->vnode) == false) {
 				// map non cacheable vnodes
-				VOP_LOCK(range->vnode);
-				__assert(VOP_MMAP(range->vnode, addr, range->offset + mapoffset, mmuflagstovnodeflags(range->mmuflags) | (range->flags & VMM_FLAGS_SHARED ? V_FFLAGS_SHARED : 0), cred) == 0);
-				VOP_UNLOCK(range->vnode);
+				MUTEX_ACQUIRE(&space->maplock, false);
+				if (arch_mmu_ispresent(current_vmm_context()->pagetable, addr) == false) {
+					VOP_LOCK(range->vnode);
+					__assert(VOP_MMAP(range->vnode, addr, range->offset + mapoffset, mmuflagstovnodeflags(range->mmuflags) | (range->flags & VMM_FLAGS_SHARED ? V_FFLAGS_SHARED : 0), cred) == 0);
+					VOP_UNLOCK(range->vnode);
+				}
+				MUTEX_RELEASE(&space->maplock);
 				status = true;
 			} else {
-				// cacheable vnode
+				// cacheable vnode. getting the page might need to read it from disk,
+				// so the space is unlocked while that happens and rechecked after
+				vnode_t *vnode = range->vnode;
+				uintmax_t offset = range->offset + mapoffset;
+				mmuflags_t mmuflags = range->mmuflags;
+				uintmax_t generation = space->generation;
+				VOP_HOLD(vnode);
+				RWLOCK_RELEASEREAD(&space->lock);
+
 				page_t *res = NULL;
-				int error = vmmcache_getpage(range->vnode, range->offset + mapoffset, &res);
+				int error = vmmcache_getpage(vnode, offset, &res);
+
+				RWLOCK_ACQUIREREAD(&space->lock);
+				if (space->generation != generation) {
+					// the space was changed while it was unlocked, make sure the page still belongs here
+					range = getrange(space, addr);
+					if (range == NULL || (range->flags & VMM_FLAGS_FILE) == 0 || range->vnode != vnode || range->mmuflags != mmuflags
+						|| range->offset + ((uintptr_t)addr - (uintptr_t)range->start) != offset) {
+						RWLOCK_RELEASEREAD(&space->lock);
+						if (error == 0)
+							pmm_release(pmm_getpageaddress(res));
+
+						VOP_RELEASE(vnode);
+						goto retry;
+					}
+				}
+
+				// the range still holds a reference to the vnode
+				VOP_RELEASE(vnode);
 
 				if (error == ENXIO || error == ENOMEM)  {
 					if (error == ENOMEM)
 						printf("vmm: out of memory to handle getpage (sending SIGBUS)\n");
 					// address is past the last page of the file
-					signal_signalthread(current_thread(), SIGBUS, true);
-					status = true;
+					status = faultsigbus(populate);
 				} else if (error) {
 					printf("vmm: error on vmmcache_getpage(): %d\n", error);
 					status = false;
 				} else {
-					status = arch_mmu_map(current_vmm_context()->pagetable, pmm_getpageaddress(res), addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
-					if (!status) {
-						printf("vmm: out of memory to map file into address space (sending SIGBUS)\n");
+					MUTEX_ACQUIRE(&space->maplock, false);
+					if (arch_mmu_ispresent(current_vmm_context()->pagetable, addr)) {
+						// another thread mapped it while the space was unlocked
 						pmm_release(pmm_getpageaddress(res));
-						signal_signalthread(current_thread(), SIGBUS, true);
 						status = true;
+					} else {
+						status = arch_mmu_map(current_vmm_context()->pagetable, pmm_getpageaddress(res), addr, mmuflags & ~ARCH_MMU_FLAGS_WRITE);
+						if (!status) {
+							printf("vmm: out of memory to map file into address space (sending SIGBUS)\n");
+							pmm_release(pmm_getpageaddress(res));
+							status = faultsigbus(populate);
+						} else {
+							faultaround(range, addr, mmuflags);
+						}
 					}
+					MUTEX_RELEASE(&space->maplock);
 				}
 			}
+		} else if (actions & VMM_ACTION_WRITE) {
+			// anonymous memory written to for the first time, give it its own page right away
+			status = anonwritefault(space, range, addr, populate);
 		} else {
 			// anonymous memory. map the zero'd page
-			status = arch_mmu_map(current_vmm_context()->pagetable, zeropage, addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
-			if (!status) {
-				printf("vmm: out of memory to map zero page into address space (sending SIGBUS)\n");
-				signal_signalthread(current_thread(), SIGBUS, true);
+			MUTEX_ACQUIRE(&space->maplock, false);
+			if (arch_mmu_ispresent(current_vmm_context()->pagetable, addr)) {
 				status = true;
 			} else {
-				pmm_hold(zeropage);
+				status = arch_mmu_map(current_vmm_context()->pagetable, zeropage, addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
+				if (!status) {
+					printf("vmm: out of memory to map zero page into address space (sending SIGBUS)\n");
+					status = faultsigbus(populate);
+				} else {
+					pmm_hold(zeropage);
+				}
 			}
+			MUTEX_RELEASE(&space->maplock);
 		}
 	} else if (arch_mmu_iswritable(current_vmm_context()->pagetable, addr) == false) {
 		// page present but not writeable in the page tables
@@ -619,7 +1014,9 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 		void *oldphys = arch_mmu_getphysical(current_vmm_context()->pagetable, addr);
 		if ((range->flags & VMM_FLAGS_FILE) && (range->flags & VMM_FLAGS_SHARED)) {
 			// shared file, remap it as writable
+			MUTEX_ACQUIRE(&space->maplock, false);
 			arch_mmu_remap(current_vmm_context()->pagetable, oldphys, addr, range->mmuflags);
+			MUTEX_RELEASE(&space->maplock);
 			if (vfs_iscacheable(range->vnode)) {
 				// and if its a cache page, mark it as dirty
 				VOP_LOCK(range->vnode);
@@ -629,18 +1026,39 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 
 			status = true;
 		} else {
-			// do copy on write
-			void *newphys = pmm_allocpage(PMM_SECTION_DEFAULT);
+			// copy on write is done on normal pages, so split a huge page first
+			if (arch_mmu_islarge(current_vmm_context()->pagetable, addr)) {
+				MUTEX_ACQUIRE(&space->maplock, false);
+				bool split = splithuge(addr);
+				MUTEX_RELEASE(&space->maplock);
+				if (split == false) {
+					printf("vmm: out of memory to split huge page (sending SIGBUS)\n");
+					status = faultsigbus(populate);
+					goto cleanup;
+				}
+			}
+
+			// do copy on write. the copy is done before taking the map lock
+			// and thrown away if another thread got to the page first
+			void *newphys = oldphys == zeropage ? pmm_allocpagezeroed(PMM_SECTION_DEFAULT) : pmm_allocpage(PMM_SECTION_DEFAULT);
 			if (newphys == NULL) {
 				printf("vmm: out of memory to do copy on write on address space (sending SIGBUS)\n");
-				signal_signalthread(current_thread(), SIGBUS, true);
-				status = true;
+				status = faultsigbus(populate);
 			} else {
-				memcpy(MAKE_HHDM(newphys), MAKE_HHDM(oldphys), PAGE_SIZE);
-				arch_mmu_remap(current_vmm_context()->pagetable, newphys, addr, range->mmuflags);
-				arch_mmu_invalidate_range(addr, PAGE_SIZE);
-				if ((range->flags & VMM_FLAGS_FILE) == 0 || vfs_iscacheable(range->vnode))
-					pmm_release(oldphys);
+				if (oldphys != zeropage)
+					memcpy(MAKE_HHDM(newphys), MAKE_HHDM(oldphys), PAGE_SIZE);
+
+				MUTEX_ACQUIRE(&space->maplock, false);
+				if (arch_mmu_getphysical(current_vmm_context()->pagetable, addr) != oldphys || arch_mmu_iswritable(current_vmm_context()->pagetable, addr)) {
+					MUTEX_RELEASE(&space->maplock);
+					pmm_release(newphys);
+				} else {
+					arch_mmu_remap(current_vmm_context()->pagetable, newphys, addr, range->mmuflags);
+					arch_mmu_invalidate_range(addr, PAGE_SIZE);
+					MUTEX_RELEASE(&space->maplock);
+					if ((range->flags & VMM_FLAGS_FILE) == 0 || vfs_iscacheable(range->vnode))
+						pmm_release(oldphys);
+				}
 
 				status = true;
 			}
@@ -651,10 +1069,44 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 	}
 
 	cleanup:
-	MUTEX_RELEASE(&space->lock);
+	RWLOCK_RELEASEREAD(&space->lock);
 	return status;
 }
 
+bool vmm_pagefault(void *addr, bool user, int actions) {
+	if (user == false && addr > USERSPACE_END) {
+		printf("vmm: kernel access\n");
+		return false;
+	}
+
+	addr = (void *)ROUND_DOWN((uintptr_t)addr, PAGE_SIZE);
+
+	vmmspace_t *space = getspace(addr);
+
+	if (space == NULL || (space == &kernelspace && user)) {
+		printf("vmm: no such space or space accessed is kerneç\n");
+		return false;
+	}
+
+	return fault(space, addr, actions, false);
+}
+
+// faults in a newly mapped range, stopping at the first page that can't be (like one past the end of a file)
+static void populate(vmmspace_t *space, void *start, size_t size, int flags, mmuflags_t mmuflags) {
+	if ((mmuflags & ARCH_MMU_FLAGS_READ) == 0)
+		return;
+
+	int actions = VMM_ACTION_READ;
+	// private anonymous memory gets its own pages right away
+	if ((flags & (VMM_FLAGS_FILE | VMM_FLAGS_SHARED)) == 0 && (mmuflags & ARCH_MMU_FLAGS_WRITE))
+		actions |= VMM_ACTION_WRITE;
+
+	for (uintptr_t offset = 0; offset < size; offset += PAGE_SIZE) {
+		if (fault(space, (void *)((uintptr_t)start + offset), actions, true) == false)
+			break;
+	}
+}
+
 void *vmm_getphysical(void *addr, bool hold) {
 	addr = (void *)ROUND_DOWN((uintptr_t)addr, PAGE_SIZE);
 
@@ -662,14 +1114,14 @@ void *vmm_getphysical(void *addr, bool hold) {
 	if (space == NULL)
 		return NULL;
 
-	MUTEX_ACQUIRE(&space->lock, false);
+	RWLOCK_ACQUIREREAD(&space->lock);
 
 	void *physical = arch_mmu_getphysical(current_vmm_context()->pagetable, addr);
 
 	if (hold)
 		pmm_hold(physical);
 
-	MUTEX_RELEASE(&space->lock);
+	RWLOCK_RELEASEREAD(&space->lock);
 	return physical + ((uintptr_t)addr - ROUND_DOWN((uintptr_t)addr, PAGE_SIZE));
 }
 
@@ -692,10 +1144,20 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 	if (space == NULL)
 		return NULL;
 
-	MUTEX_ACQUIRE(&space->lock, false);
+	SPACE_WRITELOCK(space);
 	vmmrange_t *range = NULL;
 
-	void *start = getfreerange(space, addr, size);
+	void *start = NULL;
+	// big anonymous mappings are aligned so that they can be backed by huge pages
+	if (hugeable(space, flags) && size >= HUGEPAGE_SIZE && (flags & (VMM_FLAGS_EXACT | VMM_FLAGS_REPLACE)) == 0) {
+		start = getfreerange(space, addr, size + HUGEPAGE_SIZE - PAGE_SIZE);
+		if (start)
+			start = (void *)ROUND_UP((uintptr_t)start, HUGEPAGE_SIZE);
+	}
+
+	if (start == NULL)
+		start = getfreerange(space, addr, size);
+
 	void *retaddr = NULL;
 	if (((flags & VMM_FLAGS_EXACT) && start != addr) || start == NULL)
 		goto cleanup;
@@ -713,10 +1175,11 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 		range->mmuflags = mmuflags;
 		__assert((flags & (VMM_FLAGS_ALLOCATE | VMM_FLAGS_PHYSICAL)) == 0);
 		// make the memory inacessible
-		changemap(space, addr, size, false, flags, 0);
-		arch_mmu_invalidate_range(addr, size);
+		mmutlbbatch_t batch = {0};
+		changemap(space, addr, size, false, flags, 0, &batch);
+		arch_mmu_invalidate_batch(&batch);
 		// and then free it
-		changemap(space, addr, size, true, flags, 0);
+		changemap(space, addr, size, true, flags, 0, NULL);
 	} else {
 		retaddr = start;
 		range->start = start;
@@ -750,7 +1213,7 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 	} else if (flags & VMM_FLAGS_ALLOCATE) {
 		// allocate to virtual memory
 		for (uintmax_t i = 0; i < size; i += PAGE_SIZE) {
-			void *allocated = pmm_allocpage(PMM_SECTION_DEFAULT);
+			void *allocated = pmm_allocpagezeroed(PMM_SECTION_DEFAULT);
 			if (allocated == NULL) {
 				retaddr = NULL;
 				goto cleanup;
@@ -772,7 +1235,6 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 				retaddr = NULL;
 				goto cleanup;
 			}
-			memset(MAKE_HHDM(allocated), 0, PAGE_SIZE);
 		}
 	}
 
@@ -781,7 +1243,11 @@ void *vmm_map(void *addr, volatile size_t size, int flags, mmuflags_t mmuflags,
 	if (start == NULL && range)
 		freerange(range);
 
-	MUTEX_RELEASE(&space->lock);
+	SPACE_WRITEUNLOCK(space);
+
+	if (retaddr && (flags & VMM_FLAGS_POPULATE))
+		populate(space, retaddr, size, flags, mmuflags);
+
 	return retaddr;
 }
 
@@ -800,16 +1266,17 @@ void vmm_unmap(void *addr, size_t size, int flags) {
 	if (space == NULL)
 		return;
 
-	MUTEX_ACQUIRE(&space->lock, false);
+	SPACE_WRITELOCK(space);
 
-	// make memory inacessible
-	changemap(space, addr, size, false, flags, 0);
-	arch_mmu_invalidate_range(addr, size);
+	// make memory inacessible, invalidating only what was actually mapped
+	mmutlbbatch_t batch = {0};
+	changemap(space, addr, size, false, flags, 0, &batch);
+	arch_mmu_invalidate_batch(&batch);
 
 	// and then free it
-	changemap(space, addr, size, true, flags, 0);
+	changemap(space, addr, size, true, flags, 0, NULL);
 
-	MUTEX_RELEASE(&space->lock);
+	SPACE_WRITEUNLOCK(space);
 }
 
 static scache_t *ctxcache;
@@ -818,8 +1285,12 @@ static void ctxctor(scache_t *cache, void *obj) {
 	vmmcontext_t *ctx = obj;
 	ctx->space.start = USERSPACE_START;
 	ctx->space.end = USERSPACE_END;
-	MUTEX_INIT(&ctx->space.lock);
+	RWLOCK_INIT(&ctx->space.lock);
+	MUTEX_INIT(&ctx->space.maplock);
+	ctx->space.generation = 0;
 	ctx->space.ranges = NULL;
+	ctx->space.root = NULL;
+	memset(&ctx->cpus, 0, sizeof(ctx->cpus));
 }
 
 vmmcontext_t *vmm_newcontext() {
@@ -855,7 +1326,7 @@ vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext) {
 	if (newcontext == NULL)
 		return NULL;
 
-	MUTEX_ACQUIRE(&oldcontext->space.lock, false);
+	SPACE_WRITELOCK(&oldcontext->space);
 
 	vmmrange_t *range = oldcontext->space.ranges;
 
@@ -870,41 +1341,34 @@ vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext) {
 		if (range->flags & VMM_FLAGS_FILE)
 			VOP_HOLD(range->vnode);
 
-		// copy any pages that are mapped
-
-		for (uintptr_t offset = 0; offset < newrange->size; offset += PAGE_SIZE) {
-			// XXX some types of mappings, like framebuffer shared mappings, will break if done this way
-			void *vaddr = (void *)((uintptr_t)newrange->start + offset);
-			void *phys = arch_mmu_getphysical(oldcontext->pagetable, vaddr);
-			if (phys == NULL)
-				continue;
-
-			if (arch_mmu_map(newcontext->pagetable, phys, vaddr, newrange->mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false)
-				goto error;
-
-			pmm_hold(phys);
-
-			arch_mmu_remap(oldcontext->pagetable, phys, vaddr, newrange->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
-		}
+		// copy any pages that are mapped, skipping unmapped parts of the page tables.
+		// XXX some types of mappings, like framebuffer shared mappings, will break if done this way
+		if (arch_mmu_copyrange(newcontext->pagetable, oldcontext->pagetable, range->start, range->size, (range->flags & VMM_FLAGS_PHYSICAL) == 0) == false)
+			goto error;
 
 		range = range->next;
 	}
 
 	arch_mmu_invalidate_range(NULL, 0);
 
-	MUTEX_RELEASE(&oldcontext->space.lock);
+	SPACE_WRITEUNLOCK(&oldcontext->space);
+
 	return newcontext;
 	error:
-	MUTEX_RELEASE(&oldcontext->space.lock);
+	arch_mmu_invalidate_range(NULL, 0);
+	SPACE_WRITEUNLOCK(&oldcontext->space);
 	vmm_destroycontext(newcontext);
 	return NULL;
 }
 
 void vmm_switchcontext(vmmcontext_t *ctx) {
+	// a shootdown must not see the new context before its table is loaded
+	bool intstatus = interrupt_set(false);
 	if (current_thread())
 		current_thread()->vmmctx = ctx;
 	set_current_vmm_context(ctx);
-	arch_mmu_switch(ctx->pagetable);
+	arch_mmu_switch(ctx->pagetable, &ctx->cpus);
+	interrupt_set(intstatus);
 }
 
 extern void *_text_start;
@@ -919,7 +1383,10 @@ extern volatile struct limine_memmap_request pmm_liminemap;
 void vmm_init() {
 	// set up initial state
 	__assert(sizeof(vmmcache_t) <= PAGE_SIZE);
-	MUTEX_INIT(&kernelspace.lock);
+	RWLOCK_INIT(&kernelspace.lock);
+	MUTEX_INIT(&kernelspace.maplock);
+	RWLOCK_INIT(&vmm_kernelctx.space.lock);
+	MUTEX_INIT(&vmm_kernelctx.space.maplock);
 
 	cachelist = newcache();
 	vmm_kernelctx.pagetable = arch_mmu_newtable();
@@ -953,6 +1420,8 @@ void vmm_init() {
 	zeropage = pmm_allocpage(PMM_SECTION_DEFAULT);
 	memset(MAKE_HHDM(zeropage), 0, PAGE_SIZE);
 
+	kstat_register(hugepagekstat);
+
 	printspace(&kernelspace);
 }
 
@@ -4,12 +4,15 @@
 #include <logging.h>
 #include <kernel/timekeeper.h>
 #include <kernel/event.h>
+#include <kernel/kstat.h>
 
-#define TABLE_SIZE 4096
 #define WRITER_TICK_SECONDS 15
 
-static mutex_t mutex;
-static page_t **table;
+// every vnode keeps its cached pages in a radix tree indexed by page number, protected by its own pageslock.
+// the dirty list is global and has its own lock. the lock order is pageslock, then dirtylock.
+// page flags are changed with atomics, as they aren't all protected by the same lock.
+
+static mutex_t dirtylock;
 
 static thread_t *writerthread;
 static semaphore_t sync;
@@ -17,104 +20,154 @@ static eventheader_t syncevent;
 static eventheader_t pagereadyevent;
 size_t vmmcache_cachedpages;
 
-#define HOLD_LOCK() \
-	MUTEX_ACQUIRE(&mutex, false);
-
-#define RELEASE_LOCK() \
-	MUTEX_RELEASE(&mutex);
-
-static inline uint64_t fnv1ahash(void *buffer, size_t size);
-static uintmax_t getentry(vnode_t *vnode, uintmax_t offset) {
-	struct {
-		vnode_t *vnode;
-		uintmax_t offset;
-	} tmp;
+// sequential reads get the pages after them read in by a separate thread, so the reader doesn't wait on them.
+// the window starts at READAHEAD_MIN_PAGES and doubles up to READAHEAD_MAX_PAGES as the reader keeps up with it
+#define READAHEAD_MIN_PAGES 4
+#define READAHEAD_MAX_PAGES 64
+#define READAHEAD_QUEUE_SIZE 32
+
+typedef struct {
+	vnode_t *vnode;
+	uintmax_t page;
+	size_t count;
+} readaheadrequest_t;
+
+static thread_t *readaheadthread;
+static readaheadrequest_t readaheadqueue[READAHEAD_QUEUE_SIZE];
+static size_t readaheadhead;
+static size_t readaheadcount;
+static spinlock_t readaheadlock;
+static semaphore_t readaheadsem;
+static uintmax_t readaheadpages;
+static uintmax_t readaheadhits;
+static uintmax_t readaheadmisses;
+
+#define DIRTY_LOCK() \
+	MUTEX_ACQUIRE(&dirtylock, false);
+
+#define DIRTY_UNLOCK() \
+	MUTEX_RELEASE(&dirtylock);
+
+#define PAGES_LOCK(v) \
+	MUTEX_ACQUIRE(&(v)->pageslock, false);
+
+#define PAGES_UNLOCK(v) \
+	MUTEX_RELEASE(&(v)->pageslock);
+
+#define SET_FLAGS(p, f) __atomic_or_fetch(&(p)->flags, f, __ATOMIC_SEQ_CST)
+#define CLEAR_FLAGS(p, f) __atomic_and_fetch(&(p)->flags, ~(f), __ATOMIC_SEQ_CST)
+
+// adds page to the cache of vnode at offset with flags set, unless a page is already there, which is returned in *found.
+// the lock might be dropped and taken again to allocate the tree nodes, as the allocator could end up
+// taking pages from the cache of this same vnode.
+// expects the vnode pages lock to be held
+static int insertpage(vnode_t *vnode, uintmax_t offset, page_t *page, int flags, page_t **found) {
+	uintmax_t index = offset / PAGE_SIZE;
+	radixpreload_t preload = {0};
+	int error = 0;
 
-	tmp.vnode = vnode;
-	tmp.offset = offset;
-
-	return fnv1ahash(&tmp, sizeof(tmp)) % TABLE_SIZE;
-}
+	for (;;) {
+		*found = radixtree_get(&vnode->pages, index);
+		if (*found)
+			break;
 
-// assumes lock is held
-static page_t *findpage(vnode_t *vnode, uintmax_t offset) {
-	uintmax_t entry = getentry(vnode, offset);
+		size_t needed = radixtree_nodesneeded(&vnode->pages, index);
+		if (preload.count >= needed) {
+			page->backing = vnode;
+			page->offset = offset;
+			SET_FLAGS(page, flags);
+			radixtree_insert(&vnode->pages, index, page, &preload);
+			__atomic_add_fetch(&vmmcache_cachedpages, 1, __ATOMIC_RELAXED);
+			break;
+		}
 
-	page_t *page = table[entry];
-	while (page) {
-		if (page->backing == vnode && page->offset == offset)
+		PAGES_UNLOCK(vnode);
+		error = radixtree_preload(&preload, needed);
+		PAGES_LOCK(vnode);
+		if (error)
 			break;
-		page = page->hashnext;
 	}
 
-	return page;
+	radixtree_preloadfree(&preload);
+	return error;
 }
 
-// assumes lock is held
-static void putpage(page_t *page) {
-	uintmax_t entry = getentry(page->backing, page->offset);
-	// add to table list
-	page->hashprev = NULL;
-	page->hashnext = table[entry];
-	if (table[entry])
-		table[entry]->hashprev = page;
-
-	table[entry] = page;
-
-	// add to vnode list
-	// XXX this could be a bit slow if a large portion of the file is in memory and it gets purged
-	page->vnodeprev = NULL;
-	page->vnodenext = page->backing->pages;
-	if (page->backing->pages)
-		page->backing->pages->vnodeprev = page;
-
-	page->backing->pages = page;
-	++vmmcache_cachedpages;
-}
-
-// assumes lock is held
+// expects the pages lock of the backing vnode to be held
 static void removepage(page_t *page) {
-	uintmax_t entry = getentry(page->backing, page->offset);
-
-	// remove from table list
-	if (page->hashnext)
-		page->hashnext->hashprev = page->hashprev;
+	__assert(radixtree_remove(&page->backing->pages, page->offset / PAGE_SIZE) == page);
+	__atomic_sub_fetch(&vmmcache_cachedpages, 1, __ATOMIC_RELAXED);
+}
 
-	if (page->hashprev)
-		page->hashprev->hashnext = page->hashnext;
-	else
-		table[entry] = page->hashnext;
+// reads in a run of pages this thread added to the cache with a single VOP_GETPAGE and wakes up the threads
+// waiting for them to be ready. if it fails, the pages are removed from the cache and the references of the caller are released
+static int pagein(vnode_t *vnode, uintmax_t offset, page_t **pages, size_t count) {
+	VOP_LOCK(vnode);
+	int error = VOP_GETPAGE(vnode, offset, pages, count);
+	VOP_UNLOCK(vnode);
+
+	if (error) {
+		// an error happened with GETPAGE, remove the pages from the cache,
+		// tell the sleeping threads that something happened and free the pages
+		// by setting backing to null so they get treated as anonymous pages again
+		PAGES_LOCK(vnode);
+		for (size_t i = 0; i < count; ++i) {
+			if ((pages[i]->flags & PAGE_FLAGS_TRUNCATED) == 0)
+				removepage(pages[i]);
+
+			SET_FLAGS(pages[i], PAGE_FLAGS_ERROR);
+			pages[i]->backing = NULL;
+			pages[i]->offset = 0;
+		}
+		PAGES_UNLOCK(vnode);
 
-	page->hashnext = NULL;
-	page->hashprev = NULL;
+		for (size_t i = 0; i < count; ++i)
+			pmm_release(pmm_getpageaddress(pages[i]));
 
-	// remove from vnode list
-	if (page->vnodenext)
-		page->vnodenext->vnodeprev = page->vnodeprev;
+		EVENT_SIGNAL(&pagereadyevent);
+		return error;
+	}
 
-	if (page->vnodeprev)
-		page->vnodeprev->vnodenext = page->vnodenext;
-	else
-		page->backing->pages = page->vnodenext;
+	for (size_t i = 0; i < count; ++i)
+		SET_FLAGS(pages[i], PAGE_FLAGS_READY);
 
-	page->vnodenext = NULL;
-	page->vnodeprev = NULL;
-	--vmmcache_cachedpages;
+	EVENT_SIGNAL(&pagereadyevent);
+	return 0;
 }
 
 int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 	__assert(vnode->type == V_TYPE_REGULAR || vnode->type == V_TYPE_BLKDEV);
 	__assert((offset % PAGE_SIZE) == 0);
 	retry_err:
-	HOLD_LOCK();
+	PAGES_LOCK(vnode);
 
 	page_t *newpage = NULL;
-	volatile page_t *page = findpage(vnode, offset);
-	retry:
+	volatile page_t *page = radixtree_get(&vnode->pages, offset / PAGE_SIZE);
+	if (page == NULL) {
+		// page is not present in the cache, we will have to load it in
+		PAGES_UNLOCK(vnode);
+
+		void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+		if (address == NULL)
+			return ENOMEM;
+
+		newpage = pmm_getpage(address);
+
+		PAGES_LOCK(vnode);
+
+		// while the lock wasn't being held, the page could have potentially been added to the cache.
+		// in that case it is returned as if it was always there in the first place
+		int error = insertpage(vnode, offset, newpage, 0, (page_t **)&page);
+		if (error) {
+			PAGES_UNLOCK(vnode);
+			pmm_release(address);
+			return error;
+		}
+	}
+
 	if (page) {
 		// page is present in the page cache
 		pmm_hold(pmm_getpageaddress((page_t *)page));
-		RELEASE_LOCK();
+		PAGES_UNLOCK(vnode);
 
 		// in the case of a retry, release the allocated page here
 		if (newpage)
@@ -136,89 +189,170 @@ int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 			goto retry_err;
 		}
 
+		// first use of a page brought in by readahead
+		if ((page->flags & PAGE_FLAGS_READAHEAD) && (__atomic_fetch_and(&page->flags, ~PAGE_FLAGS_READAHEAD, __ATOMIC_SEQ_CST) & PAGE_FLAGS_READAHEAD))
+			__atomic_add_fetch(&readaheadhits, 1, __ATOMIC_RELAXED);
+
 		*res = (page_t *)page;
-	} else {
-		// page is not present in the cache, we will have to load it in
-		RELEASE_LOCK();
+		return 0;
+	}
 
-		void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
-		if (address == NULL)
-			return ENOMEM;
+	PAGES_UNLOCK(vnode);
 
-		newpage = pmm_getpage(address);
-		
-		HOLD_LOCK();
+	int error = pagein(vnode, offset, &newpage, 1);
+	if (error)
+		return error;
 
-		// while the lock wasn't being held, the page could have potentially been added to the cache
-		// check for it again and return from the function as if it was always there in the first place
-		page = findpage(vnode, offset);
-		if (page)
-			goto retry;
+	*res = newpage;
+	return 0;
+}
 
-		newpage->backing = vnode;
-		newpage->offset = offset;
+// returns the page held if its already in the cache and ready to be used, without doing any I/O
+page_t *vmmcache_trygetpage(vnode_t *vnode, uintmax_t offset) {
+	__assert((offset % PAGE_SIZE) == 0);
+	PAGES_LOCK(vnode);
 
-		// add it to the page cache
-		putpage(newpage);
+	page_t *page = radixtree_get(&vnode->pages, offset / PAGE_SIZE);
+	if (page && (page->flags & PAGE_FLAGS_READY))
+		pmm_hold(pmm_getpageaddress(page));
+	else
+		page = NULL;
 
-		RELEASE_LOCK();
+	PAGES_UNLOCK(vnode);
+	return page;
+}
 
-		VOP_LOCK(vnode);
-		int error = VOP_GETPAGE(vnode, offset, newpage);
-		VOP_UNLOCK(vnode);
+// returns whether there is a page in the cache at offset, ready or not
+bool vmmcache_iscached(vnode_t *vnode, uintmax_t offset) {
+	__assert((offset % PAGE_SIZE) == 0);
+	PAGES_LOCK(vnode);
+	bool cached = radixtree_get(&vnode->pages, offset / PAGE_SIZE) != NULL;
+	PAGES_UNLOCK(vnode);
+	return cached;
+}
 
-		if (error) {
-			// an error happened with GETPAGE, remove the page from the cache,
-			// tell the sleeping threads that something happened and free the page
-			// by setting backing to null so it gets treated as an anonymous page again
-			HOLD_LOCK();
-			removepage(newpage);
+// adds a new page that isn't ready yet to the cache at offset and returns it held.
+// returns NULL if there already is a page there or if it couldn't be added
+static page_t *addpage(vnode_t *vnode, uintmax_t offset, int flags, int *error) {
+	*error = 0;
+	PAGES_LOCK(vnode);
+	page_t *found = radixtree_get(&vnode->pages, offset / PAGE_SIZE);
+	PAGES_UNLOCK(vnode);
+	if (found)
+		return NULL;
+
+	void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+	if (address == NULL) {
+		*error = ENOMEM;
+		return NULL;
+	}
 
-			newpage->flags |= PAGE_FLAGS_ERROR;
-			newpage->backing = NULL;
-			newpage->offset = 0;
+	page_t *page = pmm_getpage(address);
 
-			RELEASE_LOCK();
-			pmm_release(pmm_getpageaddress(newpage));
-			EVENT_SIGNAL(&pagereadyevent);
-			return error;
-		}
+	PAGES_LOCK(vnode);
+	*error = insertpage(vnode, offset, page, flags, &found);
+	PAGES_UNLOCK(vnode);
 
-		newpage->flags |= PAGE_FLAGS_READY;
-		EVENT_SIGNAL(&pagereadyevent);
-		*res = newpage;
+	if (*error || found) {
+		pmm_release(address);
+		return NULL;
 	}
 
-	RELEASE_LOCK();
-	return 0;
+	return page;
 }
 
-// adds a page to the cache in a specific offset if its not already there
-int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page) {
+// for writes covering the whole page at offset. a page that isn't cached is added without reading it from
+// the disk and returned not ready with *fill set, the caller fills it and then calls vmmcache_endfill.
+// a cached page is returned ready, as vmmcache_getpage does
+int vmmcache_getpagetofill(vnode_t *vnode, uintmax_t offset, page_t **res, bool *fill) {
 	__assert((offset % PAGE_SIZE) == 0);
-	HOLD_LOCK();
+	int error;
+	page_t *page = addpage(vnode, offset, 0, &error);
+	if (error)
+		return error;
 
-	page_t *pagetest = findpage(vnode, offset);
-	if (pagetest) {
-		RELEASE_LOCK();
-		return EAGAIN;
+	*fill = page != NULL;
+	if (page) {
+		*res = page;
+		return 0;
 	}
 
-	page->backing = vnode;
-	page->offset = offset;
-	page->flags |= PAGE_FLAGS_READY;
+	return vmmcache_getpage(vnode, offset, res);
+}
 
-	putpage(page);
+// makes a page from vmmcache_getpagetofill ready once the caller has filled it whole.
+// nothing that could fault may be done while filling it
+void vmmcache_endfill(page_t *page) {
+	SET_FLAGS(page, PAGE_FLAGS_READY);
+	EVENT_SIGNAL(&pagereadyevent);
+}
 
-	RELEASE_LOCK();
-	return 0;
+// brings the pages in the range that aren't cached yet in without keeping them held, reading each run of
+// missing pages with as few VOP_GETPAGE calls as possible. stops at the first error, such as reaching the end of the file
+static int pageinrange(vnode_t *vnode, uintmax_t index, size_t count, int flags) {
+	page_t *run[VFS_PAGE_CLUSTER_MAX];
+	size_t runcount = 0;
+	uintmax_t runindex = 0;
+	int error = 0;
+
+	for (uintmax_t i = index; i < index + count && error == 0; ++i) {
+		page_t *page = addpage(vnode, i * PAGE_SIZE, flags, &error);
+		if (page) {
+			if (runcount == 0)
+				runindex = i;
+
+			run[runcount++] = page;
+		}
+
+		// a page that was already cached ends the run
+		if (runcount && (page == NULL || runcount == VFS_PAGE_CLUSTER_MAX || i + 1 == index + count)) {
+			int e = pagein(vnode, runindex * PAGE_SIZE, run, runcount);
+			if (e == 0) {
+				if (flags & PAGE_FLAGS_READAHEAD)
+					__atomic_add_fetch(&readaheadpages, runcount, __ATOMIC_RELAXED);
+
+				// leave them in the standby list until they are used
+				for (size_t j = 0; j < runcount; ++j)
+					pmm_release(pmm_getpageaddress(run[j]));
+			}
+
+			if (error == 0)
+				error = e;
+
+			runcount = 0;
+		}
+	}
+
+	return error;
+}
+
+// makes sure the pages in the range are in the cache so they can be gotten with vmmcache_getpage without
+// waiting on one read per page. errors are left for vmmcache_getpage to report
+void vmmcache_pagein(vnode_t *vnode, uintmax_t offset, size_t size) {
+	__assert((offset % PAGE_SIZE) == 0);
+	pageinrange(vnode, offset / PAGE_SIZE, ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE, 0);
+}
+
+// adds a page to the cache in a specific offset if its not already there
+int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page) {
+	__assert((offset % PAGE_SIZE) == 0);
+	PAGES_LOCK(vnode);
+
+	page_t *pagetest;
+	int error = insertpage(vnode, offset, page, PAGE_FLAGS_READY, &pagetest);
+	if (error == 0 && pagetest)
+		error = EAGAIN;
+
+	PAGES_UNLOCK(vnode);
+	return error;
 }
 
 // removes a page from the cache AND turns it into anonymous memory
 int vmmcache_evict(page_t *page) {
-	HOLD_LOCK();
+	vnode_t *vnode = page->backing;
+	PAGES_LOCK(vnode);
 	if (page->refcount > 1) {
-		RELEASE_LOCK();
+		PAGES_UNLOCK(vnode);
 		return EAGAIN;
 	}
 	__assert(page->refcount == 1);
@@ -233,17 +367,18 @@ int vmmcache_evict(page_t *page) {
 	page->backing = NULL;
 	page->offset = 0;
 
-	RELEASE_LOCK();
+	PAGES_UNLOCK(vnode);
 	return 0;
 }
 
 // removes a page from the cache *but doesn't do anything to it*
 int vmmcache_takepage(page_t *page) {
-	HOLD_LOCK();
+	vnode_t *vnode = page->backing;
+	PAGES_LOCK(vnode);
 	// someone called vmmcache_getpage() and got this page while the lock wasn't held
 	// return an error status to the caller
 	if (page->refcount > 1) {
-		RELEASE_LOCK();
+		PAGES_UNLOCK(vnode);
 		return EAGAIN;
 	}
 
@@ -256,122 +391,146 @@ int vmmcache_takepage(page_t *page) {
 		removepage(page);
 	}
 
-	RELEASE_LOCK();
+	PAGES_UNLOCK(vnode);
 	return 0;
 }
 
 int vmmcache_truncate(vnode_t *vnode, uintmax_t offset) {
-	HOLD_LOCK();
-	page_t *pagelist = NULL;
-	page_t *page = vnode->pages;
-
-	while (page) {
-		page_t *oldpage = page;
-		page = page->vnodenext;
-
-		// only truncate past a certain offset
-		if (oldpage->offset < offset)
-			continue;
-
-		oldpage->flags |= PAGE_FLAGS_TRUNCATED;
-		removepage(oldpage);
-		oldpage->vnodenext = pagelist;
-		pagelist = oldpage;
-	}
+	PAGES_LOCK(vnode);
 
-	RELEASE_LOCK();
+	// only truncate past a certain offset
+	uintmax_t index = ROUND_UP(offset, PAGE_SIZE) / PAGE_SIZE;
+	page_t *page;
+	while ((page = radixtree_next(&vnode->pages, &index))) {
+		SET_FLAGS(page, PAGE_FLAGS_TRUNCATED);
+		removepage(page);
 
-	// make sure to unref if they are pinned
-	while (pagelist) {
-		page_t *page = pagelist;
-		pagelist = pagelist->vnodenext;
+		// make sure to unref if they are pinned
 		if (page->flags & PAGE_FLAGS_PINNED)
 			pmm_release(pmm_getpageaddress(page));
+
+		++index;
 	}
 
+	PAGES_UNLOCK(vnode);
 	return 0;
 }
 
-// called with lock held
-// returns with lock released
-// expects backing lock to be held
-static int syncpage(page_t *page, bool backinglock) {
-	__assert(page->flags & PAGE_FLAGS_DIRTY);
-	page->flags &= ~PAGE_FLAGS_DIRTY;
-	RELEASE_LOCK();
+// writes back a run of pages of the same vnode with contiguous offsets, splitting it around pages that got truncated
+// from the file while waiting to be written. the pages have to have been taken off of the dirty list and had the dirty flag cleared
+// expects backing lock to be held if backinglock is false
+static int writepages(page_t **pages, size_t count, bool backinglock) {
+	vnode_t *vnode = pages[0]->backing;
 	int e = 0;
-	if ((page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
-		if (backinglock)
-			VOP_LOCK(page->backing);
 
-		e = VOP_PUTPAGE(page->backing, page->offset, (page_t *)page);
+	if (backinglock)
+		VOP_LOCK(vnode);
+
+	for (size_t i = 0; i < count;) {
+		if (pages[i]->flags & PAGE_FLAGS_TRUNCATED) {
+			++i;
+			continue;
+		}
 
-		if (backinglock)
-			VOP_UNLOCK(page->backing);
-		VOP_RELEASE(page->backing);
-	} else {
-		// page got truncated from the file while waiting to be written to disk
-		// its still holding a reference to the vnode, so release that
-		VOP_RELEASE(page->backing);
+		size_t run = 1;
+		while (i + run < count && (pages[i + run]->flags & PAGE_FLAGS_TRUNCATED) == 0)
+			++run;
+
+		int error = VOP_PUTPAGE(vnode, pages[i]->offset, &pages[i], run);
+		if (e == 0)
+			e = error;
+
+		i += run;
+	}
+
+	if (backinglock)
+		VOP_UNLOCK(vnode);
+
+	// every page, truncated or not, is still holding a reference to the vnode, so release that
+	for (size_t i = 0; i < count; ++i) {
+		VOP_RELEASE(pages[i]->backing);
+		pmm_release(pmm_getpageaddress(pages[i]));
 	}
 
-	pmm_release(pmm_getpageaddress((page_t *)page));
 	return e;
 }
 
 static page_t *dirtylist;
 static page_t *dirtylistend;
 
+// expects dirtylock to be held
+static void undirty(page_t *page) {
+	__assert(page->flags & PAGE_FLAGS_DIRTY);
+
+	if (page->writenext)
+		page->writenext->writeprev = page->writeprev;
+	else
+		dirtylistend = page->writeprev;
+
+	if (page->writeprev)
+		page->writeprev->writenext = page->writenext;
+	else
+		dirtylist = page->writenext;
+
+	page->writenext = NULL;
+	page->writeprev = NULL;
+	CLEAR_FLAGS(page, PAGE_FLAGS_DIRTY);
+}
+
 // expects vnode to be held
 int vmmcache_syncvnode(vnode_t *vnode, uintmax_t offset, size_t size) {
 	offset = ROUND_DOWN(offset, PAGE_SIZE);
 	uintmax_t top = offset + size;
 	// overflow check
 	__assert(top > offset);
-	HOLD_LOCK();
+	uintmax_t topindex = ROUND_UP(top, PAGE_SIZE) / PAGE_SIZE;
+
+	PAGES_LOCK(vnode);
+	DIRTY_LOCK();
 
-	// loop through all vnode pages in memory and check which ones are in the range and are dirty
-	// TODO create a proper vnode dirty list as to not have to loop through the ENTIRE thing in memory
-	page_t *page = vnode->pages;
+	// walk the pages of the vnode in the range, take the dirty ones off of the dirty list
+	// and add them in order to an internal list using the write pointers in a singly linked list way
+	uintmax_t index = offset / PAGE_SIZE;
+	page_t *page;
 	page_t *vnodedirtylist = NULL;
-	for (; page; page = page->vnodenext) {
-		if (page->offset < offset || page->offset >= top || (page->offset & PAGE_FLAGS_DIRTY) == 0)
+	page_t *vnodedirtylistend = NULL;
+	while ((page = radixtree_next(&vnode->pages, &index)) && index < topindex) {
+		++index;
+		if ((page->flags & PAGE_FLAGS_DIRTY) == 0)
 			continue;
 
-		// remove from write list and add to an internal list using the write pointers
-		// in a singly linked list way
-		if (page->writenext)
-			page->writenext->writeprev = page->writeprev;
-
-		if (page->writeprev)
-			page->writeprev->writenext = page->writenext;
+		undirty(page);
+		if (vnodedirtylistend)
+			vnodedirtylistend->writenext = page;
 		else
-			dirtylist = page->writenext;
+			vnodedirtylist = page;
 
-		if (dirtylist == NULL)
-			dirtylistend = NULL;
-
-		page->writenext = vnodedirtylist;
-		page->writeprev = NULL;
-		vnodedirtylist = page;
+		vnodedirtylistend = page;
 	}
 
-	RELEASE_LOCK();
+	DIRTY_UNLOCK();
+	PAGES_UNLOCK(vnode);
 
+	// pages next to each other in the file are written together
+	page_t *run[VFS_PAGE_CLUSTER_MAX];
+	size_t runcount = 0;
 	int e = 0;
 	while (vnodedirtylist) {
-		// in the case of failure, only the first error to occur will be reported and we will not
-		// retry the write and keep on syncing the pages to disk
-		HOLD_LOCK();
 		page_t *page = vnodedirtylist;
 		vnodedirtylist = vnodedirtylist->writenext;
 		page->writenext = NULL;
 
-		int error = syncpage(page, false);
+		run[runcount++] = page;
+		if (vnodedirtylist && runcount < VFS_PAGE_CLUSTER_MAX && vnodedirtylist->offset == page->offset + PAGE_SIZE)
+			continue;
+
+		// in the case of failure, only the first error to occur will be reported and we will not
+		// retry the write and keep on syncing the pages to disk
+		int error = writepages(run, runcount, false);
+		runcount = 0;
 
 		if (e == 0)
 			e = error;
-		// syncpage returns with lock released
 	}
 
 	return e;
@@ -380,16 +539,16 @@ int vmmcache_syncvnode(vnode_t *vnode, uintmax_t offset, size_t size) {
 int vmmcache_sync() {
 	eventlistener_t eventlistener;
 	EVENT_INITLISTENER(&eventlistener);
-	HOLD_LOCK();
+	DIRTY_LOCK();
 	if (dirtylist == NULL) {
 		// no dirty pages
-		RELEASE_LOCK();
+		DIRTY_UNLOCK();
 		return 0;
 	}
 
 	EVENT_ATTACH(&eventlistener, &syncevent);
 	semaphore_signal(&sync);
-	RELEASE_LOCK();
+	DIRTY_UNLOCK();
 
 	EVENT_WAIT(&eventlistener, 0);
 
@@ -400,12 +559,12 @@ int vmmcache_sync() {
 // backing expected locked
 int vmmcache_makedirty(page_t *page) {
 	bool madedirty = false;
-	HOLD_LOCK();
+	DIRTY_LOCK();
 
 	if ((page->flags & (PAGE_FLAGS_DIRTY | PAGE_FLAGS_TRUNCATED)) == 0) {
 		madedirty = true;
 		// page is neither dirty nor truncated, add to dirty list and hold the page and vnode
-		page->flags |= PAGE_FLAGS_DIRTY;
+		SET_FLAGS(page, PAGE_FLAGS_DIRTY);
 
 		page->writeprev = NULL;
 		page->writenext = dirtylist;
@@ -420,7 +579,7 @@ int vmmcache_makedirty(page_t *page) {
 		VOP_HOLD(page->backing);
 	}
 
-	RELEASE_LOCK();
+	DIRTY_UNLOCK();
 	if (madedirty) {
 		vattr_t attr;
 		attr.mtime = timekeeper_time();
@@ -429,6 +588,109 @@ int vmmcache_makedirty(page_t *page) {
 	return 0;
 }
 
+static void readaheadworker() {
+	for (;;) {
+		semaphore_wait(&readaheadsem, false);
+
+		long oldipl = spinlock_acquireraiseipl(&readaheadlock, IPL_DPC);
+		__assert(readaheadcount);
+		readaheadrequest_t request = readaheadqueue[readaheadhead];
+		readaheadhead = (readaheadhead + 1) % READAHEAD_QUEUE_SIZE;
+		--readaheadcount;
+		spinlock_releaseloweripl(&readaheadlock, oldipl);
+
+		pageinrange(request.vnode, request.page, request.count, PAGE_FLAGS_READAHEAD);
+		VOP_RELEASE(request.vnode);
+	}
+}
+
+// queues count pages starting at page to be read in, returns false if the queue is full
+static bool readaheadsubmit(vnode_t *vnode, uintmax_t page, size_t count) {
+	long oldipl = spinlock_acquireraiseipl(&readaheadlock, IPL_DPC);
+	bool queued = readaheadcount < READAHEAD_QUEUE_SIZE;
+	if (queued) {
+		readaheadrequest_t *request = &readaheadqueue[(readaheadhead + readaheadcount) % READAHEAD_QUEUE_SIZE];
+		request->vnode = vnode;
+		request->page = page;
+		request->count = count;
+		++readaheadcount;
+		VOP_HOLD(vnode);
+	}
+	spinlock_releaseloweripl(&readaheadlock, oldipl);
+
+	if (queued)
+		semaphore_signal(&readaheadsem);
+
+	return queued;
+}
+
+// called by the read path with the range about to be read, nodesize being the size of the vnode.
+// a read is sequential if it starts in the page the previous one ended in or the one after it.
+// once the reader is past half of the window, the pages after what was already submitted are queued
+// and the window doubles
+void vmmcache_readahead(vnode_t *vnode, vfsreadahead_t *readahead, uintmax_t offset, size_t size, uintmax_t nodesize) {
+	uintmax_t first = offset / PAGE_SIZE;
+	uintmax_t end = ROUND_UP(offset + size, PAGE_SIZE) / PAGE_SIZE;
+	uintmax_t nodepages = ROUND_UP(nodesize, PAGE_SIZE) / PAGE_SIZE;
+	bool sequential = first == readahead->lastpage || first == readahead->lastpage + 1;
+	readahead->lastpage = end - 1;
+
+	if (sequential == false) {
+		readahead->window = 0;
+		return;
+	}
+
+	uintmax_t start;
+	if (readahead->window == 0) {
+		// start of a sequential stream, readahead covers this read from its first page not cached yet
+		start = first;
+		while (start < end && vmmcache_iscached(vnode, start * PAGE_SIZE))
+			++start;
+
+		readahead->nextpage = start;
+		readahead->window = min(end - first > READAHEAD_MIN_PAGES ? end - first : READAHEAD_MIN_PAGES, READAHEAD_MAX_PAGES);
+	} else {
+		// pages the reader got to before readahead was submitted for them
+		uintmax_t missedfrom = first > readahead->nextpage ? first : readahead->nextpage;
+		if (end > missedfrom)
+			__atomic_add_fetch(&readaheadmisses, end - missedfrom, __ATOMIC_RELAXED);
+
+		if (readahead->nextpage > end + readahead->window / 2)
+			return;
+
+		start = readahead->nextpage > end ? readahead->nextpage : end;
+		readahead->window = min(readahead->window * 2, READAHEAD_MAX_PAGES);
+	}
+
+	uintmax_t top = min(end + readahead->window, nodepages);
+	if (start < top && readaheadsubmit(vnode, start, top - start))
+		readahead->nextpage = top;
+}
+
+// puts page in run along with the dirty pages following it in its vnode, taking them off of the dirty list
+// so they are written back together. page has to have been taken off of the dirty list already
+static size_t clusterdirty(page_t *page, page_t **run) {
+	vnode_t *vnode = page->backing;
+	uintmax_t index = page->offset / PAGE_SIZE;
+	size_t count = 1;
+	run[0] = page;
+
+	PAGES_LOCK(vnode);
+	DIRTY_LOCK();
+	while (count < VFS_PAGE_CLUSTER_MAX) {
+		page_t *next = radixtree_get(&vnode->pages, index + count);
+		if (next == NULL || (next->flags & PAGE_FLAGS_DIRTY) == 0)
+			break;
+
+		undirty(next);
+		run[count++] = next;
+	}
+	DIRTY_UNLOCK();
+	PAGES_UNLOCK(vnode);
+
+	return count;
+}
+
 static void tick(context_t *, dpcarg_t arg) {
 	semaphore_signal(&sync);
 }
@@ -440,38 +702,47 @@ static void writer() {
 	timer_insert(current_cpu()->timer, &timerentry, tick, NULL, (uintmax_t)WRITER_TICK_SECONDS * 1000000, true);
 	interrupt_set(true);
 	for (;;) {
-		HOLD_LOCK();
-		volatile page_t *page = dirtylistend;
+		DIRTY_LOCK();
+		page_t *page = dirtylistend;
 		if (page == NULL) {
 			EVENT_SIGNAL(&syncevent);
-			RELEASE_LOCK();
+			DIRTY_UNLOCK();
 			semaphore_wait(&sync, false);
 			continue;
 		}
 
-		dirtylistend = page->writeprev;
-		if (dirtylistend)
-			dirtylistend->writenext = NULL;
-		else
-			dirtylist = NULL;
+		undirty(page);
+		DIRTY_UNLOCK();
 
-		page->writeprev = NULL;
+		page_t *run[VFS_PAGE_CLUSTER_MAX];
+		size_t runcount = clusterdirty(page, run);
 		// TODO notify error on vmmcache_syncvnode
-		syncpage((page_t *)page, true);
+		writepages(run, runcount, true);
 	}
 }
 
+static void vmmcachekstat(kstatbuffer_t *buffer) {
+	kstat_printf(buffer, "vmmcache.cachedpages: %lu\n", vmmcache_cachedpages);
+	kstat_printf(buffer, "vmmcache.readahead.pages: %lu\n", readaheadpages);
+	kstat_printf(buffer, "vmmcache.readahead.hits: %lu\n", readaheadhits);
+	kstat_printf(buffer, "vmmcache.readahead.misses: %lu\n", readaheadmisses);
+}
+
 void vmmcache_init() {
-	MUTEX_INIT(&mutex);
-	table = vmm_map(NULL, TABLE_SIZE * sizeof(page_t *), VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
-	__assert(table);
-	memset(table, 0, TABLE_SIZE * sizeof(page_t *));
+	MUTEX_INIT(&dirtylock);
 
 	SEMAPHORE_INIT(&sync, 0);
 	writerthread = sched_newthread(writer, PAGE_SIZE * 16, 1, NULL, NULL);
 	__assert(writerthread);
 	sched_queue(writerthread);
+
+	SEMAPHORE_INIT(&readaheadsem, 0);
+	readaheadthread = sched_newthread(readaheadworker, PAGE_SIZE * 16, 1, NULL, NULL);
+	__assert(readaheadthread);
+	sched_queue(readaheadthread);
+
 	vmmcache_sync();
 	EVENT_INITHEADER(&syncevent);
 	EVENT_INITHEADER(&pagereadyevent);
+	kstat_register(vmmcachekstat);
 }
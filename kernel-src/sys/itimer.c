@@ -1,23 +1,46 @@
 #include <kernel/itimer.h>
+#include <kernel/timekeeper.h>
 #include <logging.h>
 
+// itimers can be paused and resumed from any cpu. the entry is cancelled on the timer of the cpu it was armed on,
+// and armed again on the current one. if it had already fired the dpc might still be queued on the other cpu,
+// so the entry can't be reused until it runs: it is left to the dpc to arm it again if it was resumed in the meantime.
+
+static void arm(itimer_t *itimer, uintmax_t us);
+
 static void itimer_dpc(context_t *context, dpcarg_t arg) {
 	itimer_t *itimer = arg;
 	spinlock_acquire(&itimer->lock);
+	if (itimer->firing) {
+		// the itimer was paused after the entry fired
+		itimer->firing = false;
+		if (itimer->paused == false) {
+			uintmax_t now = timespec_ns(timekeeper_timefromboot());
+			arm(itimer, itimer->deadline > now ? ROUND_UP(itimer->deadline - now, 1000) / 1000 : 1);
+		}
+		goto leave;
+	}
+
 	if (itimer->paused)
 		goto leave;
 	
 	itimer->remainingus = itimer->repeatus ? itimer->repeatus : 0;
 	itimer->paused = itimer->repeatus == 0;
 	itimer->fn(context, itimer->arg);
-	if (itimer->repeatus) {
-		timer_insert(current_cpu()->timer, &itimer->entry, itimer_dpc, itimer, itimer->remainingus, false);
-	}
+	if (itimer->repeatus)
+		arm(itimer, itimer->remainingus);
 
 	leave:
 	spinlock_release(&itimer->lock);
 }
 
+// expects the itimer lock to be held with interrupts disabled
+static void arm(itimer_t *itimer, uintmax_t us) {
+	itimer->cpu = current_cpu();
+	itimer->deadline = timespec_ns(timekeeper_timefromboot()) + us * 1000;
+	timer_insert(current_cpu()->timer, &itimer->entry, itimer_dpc, itimer, us, false);
+}
+
 void itimer_init(itimer_t *itimer, dpcfn_t fn, dpcarg_t arg) {
 	memset(itimer, 0, sizeof(itimer_t));
 	itimer->fn = fn;
@@ -30,28 +53,19 @@ void itimer_pause(itimer_t *itimer, uintmax_t *remainingus, uintmax_t *repeatus)
 	bool intstatus = interrupt_set(false);
 	spinlock_acquire(&itimer->lock);
 
-
-	while (itimer->cpu && itimer->cpu != current_cpu()) {
-		// schedule on the itimer cpu
-		spinlock_release(&itimer->lock);
-		sched_reschedule_on_cpu(itimer->cpu, false);
-		spinlock_acquire(&itimer->lock);
-	}
-
 	if (itimer->paused)
 		goto cleanup;
 
-	itimer->cpu = NULL;
-	itimer->remainingus = timer_remove(current_cpu()->timer, &itimer->entry);
-	if (itimer->remainingus == 0) {
-		// while we were running in the cpu, the timer fired.
-		// the dpc won't be handled because the timer entry
-		// has already been removed from the queue.
-		// this will be handled as a ''timer was one microsecond away from firing''
-		// situation as its the cleanest way of doing this.
-		itimer->remainingus = 1;
-	}
+	// if the entry fired while the lock was being acquired its dpc is still on the way
+	if (itimer->firing == false && timer_cancel(itimer->cpu->timer, &itimer->entry) == false)
+		itimer->firing = true;
+
+	// a timer which fired but wasn't handled yet is treated as ''one microsecond away from firing'',
+	// as its the cleanest way of doing this.
+	uintmax_t now = timespec_ns(timekeeper_timefromboot());
+	itimer->remainingus = itimer->deadline > now ? ROUND_UP(itimer->deadline - now, 1000) / 1000 : 1;
 	itimer->paused = true;
+
 	cleanup:
 
 	spinlock_release(&itimer->lock);
@@ -78,9 +92,11 @@ void itimer_resume(itimer_t *itimer) {
 	spinlock_acquire(&itimer->lock);
 
 	__assert(itimer->paused && itimer->remainingus);
-	itimer->cpu = current_cpu();
 	itimer->paused = false;
-	timer_insert(current_cpu()->timer, &itimer->entry, itimer_dpc, itimer, itimer->remainingus, false);
+	if (itimer->firing)
+		itimer->deadline = timespec_ns(timekeeper_timefromboot()) + itimer->remainingus * 1000;
+	else
+		arm(itimer, itimer->remainingus);
 
 	spinlock_release(&itimer->lock);
 	interrupt_set(intstatus);
@@ -9,6 +9,7 @@
 #include <kernel/elf.h>
 #include <kernel/devfs.h>
 #include <kernel/cmdline.h>
+#include <kernel/timekeeper.h>
 
 static hashtable_t pid_table;
 static scache_t *processcache;
@@ -306,6 +307,8 @@ void proc_run_init() {
 
 	init_proc = proc;
 
+	__assert(timekeeper_mapuserpage() == 0);
+
 	vnode_t *initnode;
 	__assert(vfs_open(vfsroot, "/init", 0, &initnode) == 0);
 
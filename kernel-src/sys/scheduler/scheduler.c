@@ -13,93 +13,295 @@
 #include <kernel/cmdline.h>
 #include <kernel/auth.h>
 #include <arch/smp.h>
+#include <kernel/timekeeper.h>
+#include <kernel/kstat.h>
 
 #define QUANTUM_US 100000
+#define MIN_QUANTUM_US 10000
 #define SCHEDULER_STACK_SIZE PAGE_SIZE * 16
 
-#define RUNQUEUE_COUNT 64
+// every cpu has its own run queue, with one list per priority and a bitmap of the non empty ones.
+// threads pinned with sched_target_cpu are only ever queued on their cpu. a cpu with nothing to run
+// steals from the busiest other cpu, and every scheduler tick a cpu pulls work from the busiest one
+// if that has at least BALANCE_THRESHOLD more threads queued.
+// the run queue locks are only taken with interrupts disabled and never nested.
 
-typedef struct {
-	thread_t *list;
-	thread_t *last;
-} rqueue_t;
+#define BALANCE_THRESHOLD 2
+
+#define PRIORITY_ANY 0x0fffffff
 
-static rqueue_t runqueue[RUNQUEUE_COUNT];
-static uint64_t runqueuebitmap;
-static spinlock_t runqueuelock;
+static inline uint64_t prioritymask(int minprio) {
+	return minprio >= SCHED_PRIORITY_COUNT - 1 ? ~(uint64_t)0 : ((uint64_t)2 << minprio) - 1;
+}
 
-static thread_t *getinrunqueue(rqueue_t *rq) {
-	thread_t *thread = rq->list;
+static void rqinsert(schedrunqueue_t *rq, thread_t *thread) {
+	schedqueue_t *queue = &rq->queues[thread->priority];
+	rq->bitmap |= ((uint64_t)1 << thread->priority);
 
-	while (thread) {
-		if (thread->cputarget == NULL || thread->cputarget == current_cpu())
-			break;
+	thread->prev = queue->last;
+	if (thread->prev)
+		thread->prev->next = thread;
+	else
+		queue->list = thread;
+
+	thread->next = NULL;
+	queue->last = thread;
+	__atomic_add_fetch(&rq->count, 1, __ATOMIC_SEQ_CST);
+}
+
+static void rqremove(schedrunqueue_t *rq, thread_t *thread) {
+	schedqueue_t *queue = &rq->queues[thread->priority];
+	if (thread->prev)
+		thread->prev->next = thread->next;
+	else
+		queue->list = thread->next;
 
-		thread = thread->next;
+	if (thread->next)
+		thread->next->prev = thread->prev;
+	else
+		queue->last = thread->prev;
+
+	if (queue->list == NULL)
+		rq->bitmap &= ~((uint64_t)1 << thread->priority);
+
+	__atomic_sub_fetch(&rq->count, 1, __ATOMIC_SEQ_CST);
+}
+
+// takes the first thread of the highest priority list that is at least minprio
+static thread_t *rqtake(schedrunqueue_t *rq, int minprio) {
+	uint64_t bitmap = rq->bitmap & prioritymask(minprio);
+	if (bitmap == 0)
+		return NULL;
+
+	thread_t *thread = rq->queues[__builtin_ctzll(bitmap)].list;
+	rqremove(rq, thread);
+	return thread;
+}
+
+// same as rqtake, but skips threads pinned to the cpu of the queue
+static thread_t *rqsteal(schedrunqueue_t *rq, int minprio) {
+	uint64_t bitmap = rq->bitmap & prioritymask(minprio);
+	while (bitmap) {
+		int priority = __builtin_ctzll(bitmap);
+		for (thread_t *thread = rq->queues[priority].list; thread; thread = thread->next) {
+			if (thread->cputarget == NULL) {
+				rqremove(rq, thread);
+				return thread;
+			}
+		}
+
+		bitmap &= ~((uint64_t)1 << priority);
 	}
 
-	if (thread) {
-		if (thread->prev)
-			thread->prev->next = thread->next;
-		else
-			rq->list = thread->next;
-
-		if (thread->next)
-			thread->next->prev = thread->prev;
-		else
-			rq->last = thread->prev;
+	return NULL;
+}
+
+// the run queue counts are read without the locks. they are only used as a hint,
+// except for the ordering with schedtickus (see updatetick)
+static inline size_t rqcount(cpu_t *cpu) {
+	return __atomic_load_n(&cpu->runqueue.count, __ATOMIC_SEQ_CST);
+}
+
+static cpu_t *busiestcpu() {
+	cpu_t *busiest = NULL;
+	size_t busiestcount = 0;
+	for (int i = 0; smp_cpus && i < arch_smp_cpusawake; ++i) {
+		cpu_t *cpu = smp_cpus[i];
+		size_t count = rqcount(cpu);
+		if (cpu != current_cpu() && count > busiestcount) {
+			busiest = cpu;
+			busiestcount = count;
+		}
 	}
 
+	return busiest;
+}
+
+static thread_t *steal(int minprio) {
+	cpu_t *busiest = busiestcpu();
+	if (busiest == NULL)
+		return NULL;
+
+	spinlock_acquire(&busiest->runqueue.lock);
+	thread_t *thread = rqsteal(&busiest->runqueue, minprio);
+	spinlock_release(&busiest->runqueue.lock);
 	return thread;
 }
 
-static thread_t *runqueuenext(int minprio) {
+// called every scheduler tick
+static void balance() {
 	bool intstate = interrupt_set(false);
+	cpu_t *busiest = busiestcpu();
+	schedrunqueue_t *rq = &current_cpu()->runqueue;
+	if (busiest == NULL || rqcount(busiest) < rqcount(current_cpu()) + BALANCE_THRESHOLD)
+		goto leave;
 
-	thread_t *thread = NULL;
+	spinlock_acquire(&busiest->runqueue.lock);
+	thread_t *thread = rqsteal(&busiest->runqueue, PRIORITY_ANY);
+	spinlock_release(&busiest->runqueue.lock);
 
-	if (runqueuebitmap == 0)
-		goto leave;
+	if (thread) {
+		spinlock_acquire(&rq->lock);
+		rqinsert(rq, thread);
+		spinlock_release(&rq->lock);
+	}
+
+	leave:
+	interrupt_set(intstate);
+}
+
+static inline bool cpuidle(cpu_t *cpu) {
+	return cpu->idlethread && __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED) == cpu->idlethread && rqcount(cpu) == 0;
+}
+
+// pinned threads go to their cpu. others go back to the cpu they last ran on for its warm cache,
+// unless the current cpu has less work queued. if that cpu is busy but another one is idle, the idle one is used
+static cpu_t *selectcpu(thread_t *thread) {
+	if (thread->cputarget)
+		return thread->cputarget;
+
+	cpu_t *target = thread->cpu;
+	if (target == NULL || target == current_cpu() || rqcount(target) > rqcount(current_cpu()))
+		target = current_cpu();
 
-	// TODO use the bitmap for this
-	for (int i = 0; i < RUNQUEUE_COUNT && i <= minprio && thread == NULL; ++i) {
-		thread = getinrunqueue(&runqueue[i]);
-		if (thread && runqueue[i].list == NULL)
-			runqueuebitmap &= ~((uint64_t)1 << i);
+	if (cpuidle(target))
+		return target;
+
+	for (int i = 0; smp_cpus && i < arch_smp_cpusawake; ++i) {
+		if (cpuidle(smp_cpus[i]))
+			return smp_cpus[i];
 	}
 
+	return target;
+}
+
+// expects interrupts to be disabled
+static thread_t *runqueuenext(int minprio) {
+	schedrunqueue_t *rq = &current_cpu()->runqueue;
+
+	spinlock_acquire(&rq->lock);
+	thread_t *thread = rqtake(rq, minprio);
+	spinlock_release(&rq->lock);
+
+	if (thread == NULL)
+		thread = steal(minprio);
+
 	if (thread)
-		thread->flags &= ~THREAD_FLAGS_QUEUED;
+		__atomic_and_fetch(&thread->flags, ~THREAD_FLAGS_QUEUED, __ATOMIC_SEQ_CST);
 
-	leave:
-	interrupt_set(intstate);
 	return thread;
 }
 
+static bool tickless;
+
+static void reschedule_timer_dpc(context_t *context, dpcarg_t arg);
+static void preempt_dpc(context_t *context, dpcarg_t arg);
+
+static time_t tickperiod(thread_t *thread) {
+	if (tickless == false)
+		return QUANTUM_US;
+
+	cpu_t *cpu = current_cpu();
+	size_t count = rqcount(cpu);
+	if (thread == cpu->idlethread || count == 0)
+		return 0;
+
+	time_t period = QUANTUM_US / (count + 1);
+	return period < MIN_QUANTUM_US ? MIN_QUANTUM_US : period;
+}
+
+// the scheduler tick is only needed to preempt the running thread for the others queued on the cpu, so
+// it is disarmed on an idle cpu or one with a single runnable thread. the more threads are waiting the
+// shorter its period gets, so they all get to run within about QUANTUM_US.
+// every thread queued on another cpu goes through runqueueinsert, which sends that cpu a reschedule if
+// its tick is disarmed, so requeues in yield and dopreempt can't leave threads on a halted cpu.
+// expects interrupts to be disabled
+static void updatetick(thread_t *thread) {
+	cpu_t *cpu = current_cpu();
+	time_t period = tickperiod(thread);
+	if (period == cpu->schedtickus)
+		goto checkidle;
+
+	if (cpu->schedtickus)
+		timer_remove(cpu->timer, &cpu->schedtimerentry);
+
+	__atomic_store_n(&cpu->schedtickus, period, __ATOMIC_SEQ_CST);
+
+	// a thread might have been queued before the store and the cpu queueing it seen the tick as armed
+	if (period == 0)
+		period = tickperiod(thread);
+
+	if (period) {
+		__atomic_store_n(&cpu->schedtickus, period, __ATOMIC_SEQ_CST);
+		timer_insert(cpu->timer, &cpu->schedtimerentry, reschedule_timer_dpc, NULL, period, true);
+	}
+
+	checkidle:
+	// the idle thread never gets a tick, so if a cpu queued a thread here while still seeing the old
+	// thread running with the tick armed, nothing would make this cpu leave the halt loop for it.
+	// the stores of cpu->thread and schedtickus are seq_cst, so either that cpu sent an ipi or this sees the thread
+	if (thread == cpu->idlethread && rqcount(cpu))
+		dpc_enqueue(&cpu->reschedule_dpc, preempt_dpc, NULL);
+}
+
+#ifdef SCHED_WAKEUP_STATS
+// wakeup latency statistics, from sched_queue to the thread running, and how many wakeups
+// preempted the current cpu or sent a reschedule ipi to another one
+static uintmax_t wakeupcount;
+static uintmax_t wakeuptotalus;
+static uintmax_t wakeupmaxus;
+static uintmax_t wakeuppreemptions;
+static uintmax_t wakeupipis;
+
+static void wakeupstatsadd(uintmax_t us) {
+	__atomic_add_fetch(&wakeupcount, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wakeuptotalus, us, __ATOMIC_RELAXED);
+
+	uintmax_t max = __atomic_load_n(&wakeupmaxus, __ATOMIC_RELAXED);
+	while (us > max && __atomic_compare_exchange_n(&wakeupmaxus, &max, us, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == false);
+}
+
+static void wakeupkstat(kstatbuffer_t *buffer) {
+	kstat_printf(buffer, "sched.wakeup.count: %lu\n", wakeupcount);
+	kstat_printf(buffer, "sched.wakeup.totalus: %lu\n", wakeuptotalus);
+	kstat_printf(buffer, "sched.wakeup.maxus: %lu\n", wakeupmaxus);
+	kstat_printf(buffer, "sched.wakeup.preemptions: %lu\n", wakeuppreemptions);
+	kstat_printf(buffer, "sched.wakeup.ipis: %lu\n", wakeupipis);
+}
+#endif
+
 static __attribute__((noreturn)) void switch_thread(thread_t *thread) {
 	interrupt_set(false);
 	thread_t* current = current_thread();
 	
-	current_cpu()->thread = thread;
+	// pairs with the load in wakeuppreempt, see updatetick
+	__atomic_store_n(&current_cpu()->thread, thread, __ATOMIC_SEQ_CST);
 
 	if(current == NULL || thread->vmmctx != current->vmmctx)
 		vmm_switchcontext(thread->vmmctx);
 
 	current_cpu()->intstatus = ARCH_CONTEXT_INTSTATUS(&thread->context);
 	thread->cpu = current_cpu();
-	// XXX make the locking of the flags field better, candidate for a r/w lock
-	spinlock_acquire(&runqueuelock);
-	if (current)
-		current->flags &= ~THREAD_FLAGS_RUNNING;
 
-	__assert((thread->flags & THREAD_FLAGS_RUNNING) == 0);
+#ifdef SCHED_WAKEUP_STATS
+	if (thread->queuedns) {
+		wakeupstatsadd((timespec_ns(timekeeper_timefromboot()) - thread->queuedns) / 1000);
+		thread->queuedns = 0;
+	}
+#endif
+
+	updatetick(thread);
+
+	// the callers have already taken the running flag off of the current thread, unless it keeps running
+	if (current != thread) {
+		__assert((thread->flags & THREAD_FLAGS_RUNNING) == 0);
+		__atomic_or_fetch(&thread->flags, THREAD_FLAGS_RUNNING, __ATOMIC_SEQ_CST);
+	}
 
 	if (current && current->flags & THREAD_FLAGS_SLEEP)
 		spinlock_release(&current->sleeplock);
 
-	thread->flags |= THREAD_FLAGS_RUNNING;
 	__assert((thread->flags & THREAD_FLAGS_QUEUED) == 0);
-	spinlock_release(&runqueuelock);
 
 	void *schedulerstack = current_cpu()->schedulerstack;
 	__assert(!((void *)thread->context.rsp < schedulerstack && (void *)thread->context.rsp >= (schedulerstack - SCHEDULER_STACK_SIZE)));
@@ -108,49 +310,89 @@ static __attribute__((noreturn)) void switch_thread(thread_t *thread) {
 	__builtin_unreachable();
 }
 
-static void runqueueinsert(thread_t *thread) {
+// makes cpu reschedule if it is idle or running a thread with a lower priority than the one just queued on it,
+// or if its tick is disarmed and nothing else would make it notice the thread.
+// the current cpu does it once interrupts are enabled again, other cpus get an ipi
+static void wakeuppreempt(cpu_t *cpu, long priority) {
+	thread_t *running = __atomic_load_n(&cpu->thread, __ATOMIC_SEQ_CST);
+	if (running && running != cpu->idlethread && running->priority <= priority && __atomic_load_n(&cpu->schedtickus, __ATOMIC_SEQ_CST))
+		return;
+
+	if (cpu == current_cpu()) {
+		if (running == NULL)
+			return;
+
+		dpc_enqueue(&cpu->reschedule_dpc, preempt_dpc, NULL);
+#ifdef SCHED_WAKEUP_STATS
+		__atomic_add_fetch(&wakeuppreemptions, 1, __ATOMIC_RELAXED);
+#endif
+	} else if (cpu->reschedule_isr) {
+		arch_smp_sendipi(cpu, cpu->reschedule_isr, ARCH_SMP_IPI_TARGET, false);
+#ifdef SCHED_WAKEUP_STATS
+		__atomic_add_fetch(&wakeupipis, 1, __ATOMIC_RELAXED);
+#endif
+	}
+}
+
+// expects interrupts to be disabled. returns the cpu the thread was queued on.
+// a cpu other than the current one is woken up here, as it might be idle with its tick disarmed and
+// never notice the thread otherwise. the caller decides whether the current cpu should be preempted
+static cpu_t *runqueueinsert(thread_t *thread) {
 	__assert((thread->flags & THREAD_FLAGS_RUNNING) == 0);
-	thread->flags |= THREAD_FLAGS_QUEUED;
+	__atomic_or_fetch(&thread->flags, THREAD_FLAGS_QUEUED, __ATOMIC_SEQ_CST);
 
-	runqueuebitmap |= ((uint64_t)1 << thread->priority);
+	// the thread can start running on another cpu as soon as the lock is released
+	long priority = thread->priority;
+	cpu_t *cpu = selectcpu(thread);
+	schedrunqueue_t *rq = &cpu->runqueue;
+	spinlock_acquire(&rq->lock);
+	rqinsert(rq, thread);
+	spinlock_release(&rq->lock);
 
-	thread->prev = runqueue[thread->priority].last;
-	if (thread->prev)
-		thread->prev->next = thread;
-	else
-		runqueue[thread->priority].list = thread;
+	if (cpu != current_cpu())
+		wakeuppreempt(cpu, priority);
 
-	thread->next = NULL;
-	runqueue[thread->priority].last = thread;
+	return cpu;
+}
+
+// makes a thread running on another cpu enter the kernel, so it goes through sched_userspacecheck and sees
+// its pending signals. needed as the cpu might have its tick disarmed while running just that thread
+void sched_kick(thread_t *thread) {
+	bool intstate = interrupt_set(false);
+	cpu_t *cpu = __atomic_load_n(&thread->cpu, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&thread->flags, __ATOMIC_SEQ_CST) & THREAD_FLAGS_RUNNING) && cpu && cpu != current_cpu() && cpu->reschedule_isr)
+		arch_smp_sendipi(cpu, cpu->reschedule_isr, ARCH_SMP_IPI_TARGET, false);
+
+	interrupt_set(intstate);
 }
 
 void sched_queue(thread_t *thread) {
 	bool intstate = interrupt_set(false);
-	spinlock_acquire(&runqueuelock);
 
 	// maybe instead of an assert, a simple return would suffice as the thread would already be queued anyways
 	__assert((thread->flags & THREAD_FLAGS_QUEUED) == 0 && (thread->flags & THREAD_FLAGS_RUNNING) == 0);
 
-	runqueueinsert(thread);
+#ifdef SCHED_WAKEUP_STATS
+	// set before queueing, as another cpu could start running the thread right away
+	thread->queuedns = timespec_ns(timekeeper_timefromboot());
+#endif
+	long priority = thread->priority;
+	if (runqueueinsert(thread) == current_cpu())
+		wakeuppreempt(current_cpu(), priority);
 
-	spinlock_release(&runqueuelock);
 	interrupt_set(intstate);
-	// TODO yield if higher priority than current thread (or send another CPU an IPI)
 }
 
 __attribute__((noreturn)) void sched_stop_current_thread() {
 	interrupt_set(false);
 
-	spinlock_acquire(&runqueuelock);
 	if (current_thread())
-		current_thread()->flags &= ~THREAD_FLAGS_RUNNING;
+		__atomic_and_fetch(&current_thread()->flags, ~THREAD_FLAGS_RUNNING, __ATOMIC_SEQ_CST);
 
-	thread_t *next = runqueuenext(0x0fffffff);
+	thread_t *next = runqueuenext(PRIORITY_ANY);
 	if (next == NULL)
 		next = current_cpu()->idlethread;
 
-	spinlock_release(&runqueuelock);
-
 	switch_thread(next);
 }
 
@@ -212,11 +454,9 @@ __attribute__((no_caller_saved_registers)) void sched_userspacecheck(context_t *
 static void yield(context_t *context, void *) {
 	thread_t *thread = current_thread();
 
-	spinlock_acquire(&runqueuelock);
-
 	bool sleeping = thread->flags & THREAD_FLAGS_SLEEP;
 
-	thread_t *next = runqueuenext(sleeping ? 0x0fffffff : thread->priority);
+	thread_t *next = runqueuenext(sleeping ? PRIORITY_ANY : thread->priority);
 	bool gotsignal = false;
 	for (int i = 1; i < NSIG && thread->proc; ++i) {
 		void *action = thread->proc->signals.actions[i].address;
@@ -240,7 +480,7 @@ static void yield(context_t *context, void *) {
 			runqueueinsert(next);
 		next = NULL;
 
-		thread->flags &= ~(THREAD_FLAGS_SLEEP | THREAD_FLAGS_INTERRUPTIBLE);
+		__atomic_and_fetch(&thread->flags, ~(THREAD_FLAGS_SLEEP | THREAD_FLAGS_INTERRUPTIBLE), __ATOMIC_SEQ_CST);
 		thread->wakeupreason = SCHED_WAKEUP_REASON_INTERRUPTED;
 		spinlock_release(&thread->sleeplock);
 	}
@@ -248,18 +488,16 @@ static void yield(context_t *context, void *) {
 	if (next || sleeping) {
 		ARCH_CONTEXT_THREADSAVE(thread, context);
 
-		thread->flags &= ~THREAD_FLAGS_RUNNING;
-		if (sleeping == false)
+		__atomic_and_fetch(&thread->flags, ~THREAD_FLAGS_RUNNING, __ATOMIC_SEQ_CST);
+		// the idle thread is never queued
+		if (sleeping == false && thread != current_cpu()->idlethread)
 			runqueueinsert(thread);
 
 		if (next == NULL)
 			next = current_cpu()->idlethread;
 
-		spinlock_release(&runqueuelock);
 		switch_thread(next);
 	}
-
-	spinlock_release(&runqueuelock);
 }
 
 int sched_yield() {
@@ -291,7 +529,6 @@ bool sched_wakeup(thread_t *thread, int reason) {
 	thread->flags &= ~(THREAD_FLAGS_SLEEP | THREAD_FLAGS_INTERRUPTIBLE);
 	thread->wakeupreason = reason;
 
-	// TODO send IPI to idle cores
 	sched_queue(thread);
 	spinlock_release(&thread->sleeplock);
 	interrupt_set(intstate);
@@ -302,20 +539,18 @@ bool sched_wakeup(thread_t *thread, int reason) {
 // once a scheduler dpc gets run, the return context is set to this function using the scheduler stack
 static void dopreempt() {
 	// interrupts are disabled, the thread context is already saved
-	spinlock_acquire(&runqueuelock);
-
 	thread_t *current = current_thread();
 	thread_t *next = runqueuenext(current->priority);
 
-	current->flags &= ~THREAD_FLAGS_PREEMPTED;
+	__atomic_and_fetch(&current->flags, ~THREAD_FLAGS_PREEMPTED, __ATOMIC_SEQ_CST);
 	if (next) {
-		current->flags &= ~THREAD_FLAGS_RUNNING;
-		runqueueinsert(current);
+		__atomic_and_fetch(&current->flags, ~THREAD_FLAGS_RUNNING, __ATOMIC_SEQ_CST);
+		if (current != current_cpu()->idlethread)
+			runqueueinsert(current);
 	} else {
 		next = current;
 	}
 
-	spinlock_release(&runqueuelock);
 	switch_thread(next);
 }
 
@@ -327,7 +562,7 @@ static void preempt_dpc(context_t *context, dpcarg_t arg) {
 	if (current->flags & THREAD_FLAGS_PREEMPTED)
 		return;
 
-	current->flags |= THREAD_FLAGS_PREEMPTED;
+	__atomic_or_fetch(&current->flags, THREAD_FLAGS_PREEMPTED, __ATOMIC_SEQ_CST);
 	ARCH_CONTEXT_THREADSAVE(current, context);
 
 	CTX_INIT(context, false, false);
@@ -337,6 +572,7 @@ static void preempt_dpc(context_t *context, dpcarg_t arg) {
 
 // IPL_DPC
 static void reschedule_timer_dpc(context_t *context, dpcarg_t arg) {
+	balance();
 	dpc_enqueue(&current_cpu()->reschedule_dpc, preempt_dpc, NULL);
 }
 
@@ -360,26 +596,23 @@ void sched_target_cpu(cpu_t *cpu) {
 	interrupt_set(intstatus);
 }
 
-// yields the current thread and sends an reschedule ipi to a specific cpu
+// yields the current thread into the run queue of the cpu it is pinned to, runqueueinsert sends that cpu the reschedule
 static void reschedule_yield(context_t *context, void *_cpu) {
 	thread_t *thread = current_thread();
 	cpu_t *cpu = _cpu;
 
-	spinlock_acquire(&runqueuelock);
-
-	thread_t *next = runqueuenext(0x0fffffff);
+	thread_t *next = runqueuenext(PRIORITY_ANY);
 
 	ARCH_CONTEXT_THREADSAVE(thread, context);
 
-	thread->flags &= ~THREAD_FLAGS_RUNNING;
-	runqueueinsert(thread);
+	// the thread is pinned to cpu, so it goes into its run queue
+	__atomic_and_fetch(&thread->flags, ~THREAD_FLAGS_RUNNING, __ATOMIC_SEQ_CST);
+	cpu_t *queuedcpu = runqueueinsert(thread);
+	__assert(queuedcpu == cpu);
 
 	if (next == NULL)
 		next = current_cpu()->idlethread;
 
-	arch_smp_sendipi(cpu, cpu->reschedule_isr, ARCH_SMP_IPI_TARGET, false);
-
-	spinlock_release(&runqueuelock);
 	switch_thread(next);
 }
 
@@ -430,6 +663,7 @@ void sched_ap_entry() {
 	current_cpu()->reschedule_isr = interrupt_allocate(reschedule_ipi, ARCH_EOI, IPL_MAX);
 	__assert(current_cpu()->reschedule_isr);
 
+	current_cpu()->schedtickus = QUANTUM_US;
 	timer_insert(current_cpu()->timer, &current_cpu()->schedtimerentry, reschedule_timer_dpc, NULL, QUANTUM_US, true);
 	timer_resume(current_cpu()->timer);
 	sched_stop_current_thread();
@@ -442,8 +676,6 @@ void sched_init() {
 	__assert(current_cpu()->schedulerstack);
 	current_cpu()->schedulerstack = (void *)((uintptr_t)current_cpu()->schedulerstack + SCHEDULER_STACK_SIZE);
 
-	SPINLOCK_INIT(runqueuelock);
-
 	current_cpu()->idlethread = sched_newthread(cpuidlethread, PAGE_SIZE * 4, 3, NULL, NULL);
 	__assert(current_cpu()->idlethread);
 	current_cpu()->thread = sched_newthread(NULL, PAGE_SIZE * 32, 0, NULL, NULL);
@@ -452,6 +684,13 @@ void sched_init() {
 	current_cpu()->reschedule_isr = interrupt_allocate(reschedule_ipi, ARCH_EOI, IPL_MAX);
 	__assert(current_cpu()->reschedule_isr);
 
+	tickless = cmdline_get("notickless") == NULL;
+
+#ifdef SCHED_WAKEUP_STATS
+	kstat_register(wakeupkstat);
+#endif
+
+	current_cpu()->schedtickus = QUANTUM_US;
 	timer_insert(current_cpu()->timer, &current_cpu()->schedtimerentry, reschedule_timer_dpc, NULL, QUANTUM_US, true);
 	// XXX move this resume to a more appropriate place
 	timer_resume(current_cpu()->timer);
@@ -291,7 +291,8 @@ void signal_signalthread(struct thread_t *thread, int signal, bool urgent) {
 
 	if (signal == SIGKILL || signal == SIGSTOP || urgent || (SIGNAL_GET(&thread->signals.mask, signal) == 0 && notignored)) {
 		// signal cannot be ignored or its urgent or its not masked and not ignored
-		sched_wakeup(thread, SCHED_WAKEUP_REASON_INTERRUPTED);
+		if (sched_wakeup(thread, SCHED_WAKEUP_REASON_INTERRUPTED) == false)
+			sched_kick(thread);
 	} else if (notignored == false) {
 		// ignored, remove from pending set
 		SIGNAL_SETOFF(sigset, signal);
@@ -342,8 +343,8 @@ void signal_signalproc(struct proc_t *proc, int signal) {
 					goto threadleave;
 				}
 
-				sched_wakeup(thread, reason);
-				// TODO ipi if running isn't self
+				if (sched_wakeup(thread, reason) == false)
+					sched_kick(thread);
 			}
 
 			// if we are stopping or continuing, this will be sent to all individual threads
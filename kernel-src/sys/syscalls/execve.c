@@ -7,6 +7,7 @@
 #include <kernel/elf.h>
 #include <kernel/scheduler.h>
 #include <logging.h>
+#include <kernel/timekeeper.h>
 
 static void freevec(char **v) {
 	char **it = v;
@@ -233,6 +234,10 @@ static syscallret_t execve(context_t *context, char *upath, char *uargv[], char
 
 	vmm_switchcontext(vmmctx);
 
+	ret.errno = timekeeper_mapuserpage();
+	if (ret.errno)
+		goto error;
+
 	auxv64list_t auxv64;
 	void *entry;
 	ret.errno = elf_load(node, NULL, &entry, &interp, &auxv64);
@@ -30,6 +30,7 @@ syscallret_t syscall_pread(context_t *context, int fd, void *buffer, size_t size
 	}
 	
 	size_t bytesread;
+	// pread is meant to be used concurrently on the same file, so it doesn't touch the readahead state of the file
 	ret.errno = vfs_read(file->vnode, buffer, size, offset, &bytesread, fileflagstovnodeflags(file->flags));
 
 	if (ret.errno)
@@ -30,7 +30,14 @@ syscallret_t syscall_read(context_t *context, int fd, void *buffer, size_t size)
 
 	size_t bytesread;
 	uintmax_t offset = file->offset;
-	ret.errno = vfs_read(file->vnode, buffer, size, file->offset, &bytesread, fileflagstovnodeflags(file->flags));
+	iovec_t iovec = {
+		.addr = buffer,
+		.len = size
+	};
+
+	iovec_iterator_t iovec_iterator;
+	iovec_iterator_init(&iovec_iterator, &iovec, 1);
+	ret.errno = vfs_read_iovec(file->vnode, &iovec_iterator, size, file->offset, &bytesread, fileflagstovnodeflags(file->flags), &file->readahead);
 
 	if (ret.errno)
 		goto cleanup;
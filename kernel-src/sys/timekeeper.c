@@ -1,41 +1,61 @@
 #include <kernel/timekeeper.h>
+#include <kernel/pmm.h>
+#include <kernel/vmm.h>
 #include <limine.h>
 #include <logging.h>
+#include <errno.h>
+
+#define MULT_SHIFT 32
 
 static volatile struct limine_boot_time_request timereq = {
 	.id = LIMINE_BOOT_TIME_REQUEST,
 	.revision = 0
 };
 
-static time_t bootunix;
-static time_t ticksperus;
 static time_t (*clockticks)();
-static time_t initclockticks;
+// the kernel reads the same conversion values as userspace does
+static timekeeperpage_t *page;
+static void *pagephysical;
 
 timespec_t timekeeper_timefromboot() {
 	timespec_t ts;
-	time_t ticks = clockticks() - initclockticks;
-	time_t uspassed = ticks / ticksperus;
-	ts.s = uspassed / 1000000;
-	ts.ns = (uspassed * 1000) % 1000000000;
+	uint64_t ns = ((unsigned __int128)(clockticks() - page->initticks) * page->mult) >> page->shift;
+	ts.s = ns / 1000000000;
+	ts.ns = ns % 1000000000;
 	return ts;
 }
 
 timespec_t timekeeper_time() {
 	timespec_t fromboot = timekeeper_timefromboot();
 	timespec_t unix;
-	unix.s = bootunix;
+	unix.s = page->bootunix;
 	unix.ns = 0;
 	return timespec_add(unix, fromboot);
 }
 
-// tick is a function that returns the amount of ticks since the timer's initialisation
-void timekeeper_init(time_t (*tick)(), time_t _ticksperus) {
+// maps the time page into the current address space, done on exec
+int timekeeper_mapuserpage() {
+	void *addr = vmm_map(TIMEKEEPER_PAGE_BASE, PAGE_SIZE, VMM_FLAGS_PHYSICAL | VMM_FLAGS_EXACT | VMM_FLAGS_READONLY,
+		ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_USER | ARCH_MMU_FLAGS_NOEXEC, pagephysical);
+
+	return addr ? 0 : ENOMEM;
+}
+
+// tick is a function that returns the amount of ticks since the timer's initialisation.
+// usertsc tells if tick can be read from userspace with rdtsc
+void timekeeper_init(time_t (*tick)(), uint64_t frequency, bool usertsc) {
 	__assert(timereq.response);
-	bootunix = timereq.response->boot_time;
-	printf("timekeeper: unix time at boot: %lu\n", bootunix);
-	initclockticks = tick();
-	ticksperus = _ticksperus;
+	__assert(frequency);
+	pagephysical = pmm_allocpagezeroed(PMM_SECTION_DEFAULT);
+	__assert(pagephysical);
+	page = MAKE_HHDM(pagephysical);
+
+	page->bootunix = timereq.response->boot_time;
+	printf("timekeeper: unix time at boot: %lu\n", page->bootunix);
+	page->shift = MULT_SHIFT;
+	page->mult = ((unsigned __int128)1000000000 << MULT_SHIFT) / frequency;
+	page->flags = usertsc ? TIMEKEEPER_PAGE_FLAGS_TSC : 0;
 	clockticks = tick;
-	printf("timekeeper: %lu clock ticks at init (%lu ticks per us)\n", initclockticks, ticksperus);
+	page->initticks = tick();
+	printf("timekeeper: %lu clock ticks at init (%lu hz)\n", page->initticks, frequency);
 }
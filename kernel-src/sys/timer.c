@@ -3,6 +3,59 @@
 #include <logging.h>
 #include <kernel/interrupt.h>
 
+// the wheel works in units of 2^unitshift ticks. an entry is kept under the unit its deadline is rounded up to,
+// so it never fires early and at most one unit late.
+// an entry goes in the lowest level where its unit only differs from wheelbase in that level's bits,
+// so everything in a level is due before everything in the levels above it and the
+// slots of a level are in deadline order starting from the one of wheelbase.
+static inline uint64_t entryunit(timer_t *timer, timerentry_t *entry) {
+	return ROUND_UP((uint64_t)entry->absolutetick, (uint64_t)1 << timer->unitshift) >> timer->unitshift;
+}
+
+static inline int levelshift(int level) {
+	return level * TIMER_WHEEL_SLOT_BITS;
+}
+
+static void wheeladd(timer_t *timer, timerentry_t *entry) {
+	uint64_t unit = entryunit(timer, entry);
+	uint64_t diff = unit ^ timer->wheelbase;
+	timerentry_t **head;
+
+	int level = 0;
+	if (unit > timer->wheelbase && diff)
+		level = (63 - __builtin_clzl(diff)) / TIMER_WHEEL_SLOT_BITS;
+
+	if (level >= TIMER_WHEEL_LEVELS) {
+		entry->level = TIMER_WHEEL_OVERFLOW;
+		entry->slot = 0;
+		head = &timer->overflow;
+	} else {
+		// an entry which is already due goes in the slot of wheelbase and is fired on the next advance
+		entry->level = level;
+		entry->slot = ((unit > timer->wheelbase ? unit : timer->wheelbase) >> levelshift(level)) & (TIMER_WHEEL_SLOTS - 1);
+		head = &timer->wheel[level][entry->slot];
+		timer->bitmap[level] |= (uint64_t)1 << entry->slot;
+	}
+
+	entry->next = *head;
+	if (entry->next)
+		entry->next->pprev = &entry->next;
+	entry->pprev = head;
+	*head = entry;
+}
+
+static void wheelremove(timer_t *timer, timerentry_t *entry) {
+	*entry->pprev = entry->next;
+	if (entry->next)
+		entry->next->pprev = entry->pprev;
+
+	if (entry->level != TIMER_WHEEL_OVERFLOW && timer->wheel[entry->level][entry->slot] == NULL)
+		timer->bitmap[entry->level] &= ~((uint64_t)1 << entry->slot);
+
+	entry->next = NULL;
+	entry->pprev = NULL;
+}
+
 static void insert(timer_t *timer, timerentry_t *entry, time_t us) {
 	entry->absolutetick = timer->tickcurrent + us * timer->ticksperus;
 	// it overflowed, this will be so far into the future we can just
@@ -10,51 +63,102 @@ static void insert(timer_t *timer, timerentry_t *entry, time_t us) {
 	if (entry->absolutetick < timer->tickcurrent)
 		entry->absolutetick = timer->ticksperus * 1000 * 1000 * 60 * 60 * 24 * 30 * 12 * 1000; // a thousand years from now.
 
-	if (timer->queue == NULL) { // if no other entries in the queue
-		entry->next = NULL;
-		timer->queue = entry;
-	} else if (timer->queue->absolutetick > entry->absolutetick) { // if the current entry should be put before all the others in the queue
-		__assert(entry->next == NULL);
-		entry->next = timer->queue;
-		timer->queue = entry;
-	} else {
-		timerentry_t *search = timer->queue;
-
-		while (search) {
-			__assert(search != entry);
-			if (search->next == NULL) { // if last entry in the queue
-				entry->next = NULL;
-				search->next = entry;
-				break;
-			} else if (entry->absolutetick >= search->absolutetick && search->next->absolutetick > entry->absolutetick) { // insert between two
-				entry->next = search->next;
-				search->next = entry;
-				break;
-			}
-			search = search->next;
-		}
+	wheeladd(timer, entry);
+	++timer->count;
+}
+
+// tick of the earliest slot in the wheel. for the levels above 0 this is the start of the slot,
+// at which point its entries get cascaded down to the lower levels
+static bool nextdeadline(timer_t *timer, time_t *deadline) {
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		if (timer->bitmap[level] == 0)
+			continue;
+
+		int shift = levelshift(level);
+		uint64_t slot = __builtin_ctzl(timer->bitmap[level]);
+		uint64_t unit = ((timer->wheelbase >> (shift + TIMER_WHEEL_SLOT_BITS)) << (shift + TIMER_WHEEL_SLOT_BITS)) | (slot << shift);
+		*deadline = unit << timer->unitshift;
+		return true;
+	}
+
+	if (timer->overflow) {
+		int shift = levelshift(TIMER_WHEEL_LEVELS);
+		*deadline = (((timer->wheelbase >> shift) + 1) << shift) << timer->unitshift;
+		return true;
 	}
+
+	return false;
 }
 
-// expects IPL to be at least IPL_TIMER
+// expects IPL to be at least IPL_TIMER.
+// with nothing queued the timer is left stopped, so an idle cpu doesn't get woken up for nothing
 static inline void arm_for_next_target(timer_t *timer) {
-	time_t target;
-	if (timer->queue)
-		target = min(timer->queue->absolutetick - timer->tickcurrent, timer->tick_limit);
-	else
-		target = timer->tick_limit;
+	time_t deadline;
+	if (nextdeadline(timer, &deadline) == false) {
+		timer->current_target = timer->tickcurrent;
+		return;
+	}
 
+	time_t target = deadline > timer->tickcurrent ? min(deadline - timer->tickcurrent, timer->tick_limit) : 1;
 	timer->current_target = timer->tickcurrent + target;
 	timer->arm(target);
 }
 
+// moves every slot up to the current tick off of the wheel, then fires the entries that are due
+// and puts the others back in the lower levels.
 // expects IPL to be at least IPL_TIMER
 static void timercheck(timer_t *timer) {
-	while (timer->queue && timer->queue->absolutetick == timer->tickcurrent) {
-		timerentry_t *entry = timer->queue;
-		timer->queue = timer->queue->next;
+	uint64_t now = (uint64_t)timer->tickcurrent >> timer->unitshift;
+	uint64_t base = timer->wheelbase;
+	timerentry_t *list = NULL;
+
+	for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+		int shift = levelshift(level);
+		uint64_t mask;
+		// if time moved past the range of the level all of its slots are reached
+		if ((now >> (shift + TIMER_WHEEL_SLOT_BITS)) != (base >> (shift + TIMER_WHEEL_SLOT_BITS)))
+			mask = ~(uint64_t)0;
+		else
+			mask = ((uint64_t)2 << ((now >> shift) & (TIMER_WHEEL_SLOTS - 1))) - 1;
+
+		uint64_t pending = timer->bitmap[level] & mask;
+		while (pending) {
+			int slot = __builtin_ctzl(pending);
+			pending &= pending - 1;
+
+			while (timer->wheel[level][slot]) {
+				timerentry_t *entry = timer->wheel[level][slot];
+				wheelremove(timer, entry);
+				entry->next = list;
+				list = entry;
+			}
+		}
+	}
+
+	int shift = levelshift(TIMER_WHEEL_LEVELS);
+	if ((now >> shift) != (base >> shift)) {
+		while (timer->overflow) {
+			timerentry_t *entry = timer->overflow;
+			wheelremove(timer, entry);
+			entry->next = list;
+			list = entry;
+		}
+	}
+
+	if (now > base)
+		timer->wheelbase = now;
+
+	while (list) {
+		timerentry_t *entry = list;
+		list = list->next;
 		entry->next = NULL;
 
+		if (entryunit(timer, entry) > timer->wheelbase) {
+			wheeladd(timer, entry);
+			continue;
+		}
+
+		--timer->count;
 		if (entry->repeatus)
 			insert(timer, entry, entry->repeatus);
 		else
@@ -67,29 +171,15 @@ static void timercheck(timer_t *timer) {
 void timer_isr(timer_t *timer, context_t *context) {
 	spinlock_acquire(&timer->lock);
 
-	__assert(timer->queue);
-
 	// check if the timer interrupt happened
 	// while the timer was about to be stopped by a timer_insert or timer_remove
 	time_t time_passed = timer->stop(timer);
-	if (time_passed < timer->current_target - timer->tickcurrent) {
+	if (time_passed < timer->current_target - timer->tickcurrent)
 		timer->tickcurrent += time_passed;
-		goto leave;
-	}
-
-	timer->tickcurrent = timer->current_target;
-	timerentry_t *oldentry = timer->queue;
-	timer->queue = timer->queue->next;
-	oldentry->next = NULL;
-
-	if (oldentry->repeatus)
-		insert(timer, oldentry, oldentry->repeatus);
 	else
-		oldentry->fired = true;
+		timer->tickcurrent = timer->current_target;
 
-	dpc_enqueue(&oldentry->dpc, oldentry->fn, oldentry->arg);
-
-	leave:
+	// the target might have been capped by tick_limit, so only the entries which are really due are fired
 	timercheck(timer);
 	arm_for_next_target(timer);
 
@@ -102,7 +192,7 @@ void timer_resume(timer_t *timer) {
 
 	timer->running = true;
 
-	if (timer->queue == NULL)
+	if (timer->count == 0)
 		goto leave;
 
 	timercheck(timer);
@@ -160,27 +250,15 @@ uintmax_t timer_remove(timer_t *timer, timerentry_t *entry) {
 	if (entry->fired == true)
 		goto cleanup;
 
-	timerentry_t *iterator = timer->queue;
-	timerentry_t *prev = NULL;
-
-	while (iterator && iterator != entry) {
-		prev = iterator;
-		iterator = iterator->next;
-	}
-
-	__assert(iterator);
-
-	if (prev == NULL)
-		timer->queue = iterator->next;
-	else
-		prev->next = iterator->next;
-
-	iterator->next = NULL;
+	__assert(entry->pprev);
+	wheelremove(timer, entry);
+	--timer->count;
 
 	// ALWAYS round up the time remaining
-	timeremaining = ROUND_UP(iterator->absolutetick - timer->tickcurrent, timer->ticksperus) / timer->ticksperus;
+	if (entry->absolutetick > timer->tickcurrent)
+		timeremaining = ROUND_UP(entry->absolutetick - timer->tickcurrent, timer->ticksperus) / timer->ticksperus;
 
-	if (timer->queue) {
+	if (timer->running) {
 		timercheck(timer);
 		arm_for_next_target(timer);
 	}
@@ -191,6 +269,25 @@ uintmax_t timer_remove(timer_t *timer, timerentry_t *entry) {
 	return timeremaining;
 }
 
+// unlike timer_remove this can be called from any cpu, as the hardware timer isn't touched.
+// if the entry was the next one due the owning cpu just gets a timer interrupt with nothing to fire.
+// returns false if the entry had already fired
+bool timer_cancel(timer_t *timer, timerentry_t *entry) {
+	long oldipl = interrupt_raiseipl(IPL_TIMER);
+	spinlock_acquire(&timer->lock);
+
+	bool cancelled = entry->fired == false;
+	if (cancelled) {
+		__assert(entry->pprev);
+		wheelremove(timer, entry);
+		--timer->count;
+	}
+
+	spinlock_release(&timer->lock);
+	interrupt_loweripl(oldipl);
+	return cancelled;
+}
+
 timer_t *timer_new(time_t ticksperus, void (*arm)(time_t), time_t (*stop)(), time_t tick_limit) {
 	timer_t *timer = alloc(sizeof(timer_t));
 	if (timer == NULL)
@@ -201,6 +298,8 @@ timer_t *timer_new(time_t ticksperus, void (*arm)(time_t), time_t (*stop)(), tim
 	timer->tick_limit = tick_limit;
 	timer->arm = arm;
 	timer->stop = stop;
+	// largest power of two not bigger than a microsecond
+	timer->unitshift = ticksperus > 1 ? 63 - __builtin_clzl(ticksperus) : 0;
 	SPINLOCK_INIT(timer->lock);
 
 	return timer;
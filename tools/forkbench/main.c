@@ -0,0 +1,109 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// measures how long fork takes for a process with a given amount of resident memory
+// and of reserved but untouched virtual memory. the time is taken in the parent from
+// right before fork to when it returns, the child exits immediately
+
+#define PAGE_SIZE 4096
+
+static void usage(char *name) {
+	fprintf(stderr, "%s: usage: %s [-n iterations] [-r resident MiB] [-v virtual MiB]\n", name, name);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t nowns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *reserve(size_t mib) {
+	if (mib == 0)
+		return NULL;
+
+	void *addr = mmap(NULL, mib * 1024 * 1024, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("forkbench: mmap failed");
+		exit(EXIT_FAILURE);
+	}
+
+	return addr;
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = 1000;
+	size_t residentmib = 0;
+	size_t virtualmib = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:v:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				residentmib = strtoull(optarg, NULL, 10);
+				break;
+			case 'v':
+				virtualmib = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (iterations == 0)
+		usage(argv[0]);
+
+	// touch every page of the resident part, the virtual part is never accessed
+	uint8_t *resident = reserve(residentmib);
+	for (size_t i = 0; i < residentmib * 1024 * 1024; i += PAGE_SIZE)
+		resident[i] = 1;
+
+	reserve(virtualmib);
+
+	uint64_t total = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+
+	for (size_t i = 0; i < iterations; ++i) {
+		uint64_t start = nowns();
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(0);
+
+		uint64_t elapsed = nowns() - start;
+		if (pid == -1) {
+			perror("forkbench: fork failed");
+			return EXIT_FAILURE;
+		}
+
+		if (waitpid(pid, NULL, 0) == -1) {
+			perror("forkbench: waitpid failed");
+			return EXIT_FAILURE;
+		}
+
+		// fork write protected the resident pages, take the faults making them writable again
+		// outside of the measured part so every iteration forks the same page tables
+		for (size_t j = 0; j < residentmib * 1024 * 1024; j += PAGE_SIZE)
+			resident[j] = 1;
+
+		total += elapsed;
+		if (elapsed < min)
+			min = elapsed;
+		if (elapsed > max)
+			max = elapsed;
+	}
+
+	printf("forkbench: %zu forks, %zu MiB resident, %zu MiB untouched: avg %lu us min %lu us max %lu us\n",
+		iterations, residentmib, virtualmib, total / iterations / 1000, min / 1000, max / 1000);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// measures how long arming and cancelling a timer takes while a given amount of other timers
+// are pending. the pending timers come from children sleeping with long and different timeouts,
+// the measured ones are the ITIMER_REAL of this process, armed and disarmed right away so they never fire
+
+static void usage(char *name) {
+	fprintf(stderr, "%s: usage: %s [-n iterations] [-t pending timers]\n", name, name);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t nowns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void settimer(uint64_t us) {
+	struct itimerval val = {
+		.it_value.tv_sec = us / 1000000,
+		.it_value.tv_usec = us % 1000000
+	};
+
+	if (setitimer(ITIMER_REAL, &val, NULL) == -1) {
+		perror("timerbench: setitimer failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = 100000;
+	size_t timers = 1000;
+	int status = EXIT_FAILURE;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				timers = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (iterations == 0)
+		usage(argv[0]);
+
+	pid_t *children = malloc(timers * sizeof(pid_t));
+	int readyfds[2];
+	if ((timers && children == NULL) || pipe(readyfds) == -1) {
+		perror("timerbench: setup failed");
+		return EXIT_FAILURE;
+	}
+
+	// the children spread their deadlines from one minute to a few hours so they don't all land
+	// in the same place, and tell the parent when they are about to go to sleep
+	for (size_t i = 0; i < timers; ++i) {
+		children[i] = fork();
+		if (children[i] == 0) {
+			struct timespec ts = {
+				.tv_sec = 60 + (i * 7919) % 10000
+			};
+			write(readyfds[1], "", 1);
+			for (;;)
+				nanosleep(&ts, NULL);
+		}
+
+		if (children[i] == -1) {
+			perror("timerbench: fork failed");
+			timers = i;
+			goto cleanup;
+		}
+	}
+
+	char c;
+	for (size_t i = 0; i < timers; ++i) {
+		if (read(readyfds[0], &c, 1) != 1) {
+			perror("timerbench: read failed");
+			goto cleanup;
+		}
+	}
+
+	// give the last ones time to actually get to sleep
+	usleep(100000);
+
+	// the deadlines of the measured timer go from a millisecond to a second
+	uint64_t start = nowns();
+	for (size_t i = 0; i < iterations; ++i) {
+		settimer((i % 1000 + 1) * 1000);
+		settimer(0);
+	}
+	uint64_t elapsed = nowns() - start;
+
+	printf("timerbench: %zu arms and cancels, %zu timers pending: %lu ns per arm and cancel\n",
+		iterations, timers, elapsed / iterations);
+	status = EXIT_SUCCESS;
+
+	cleanup:
+	for (size_t i = 0; i < timers; ++i)
+		kill(children[i], SIGKILL);
+
+	for (size_t i = 0; i < timers; ++i)
+		waitpid(children[i], NULL, 0);
+
+	return status;
+}